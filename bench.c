@@ -0,0 +1,386 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <va/va.h>
+#include <libdrm/drm_fourcc.h>
+
+#include "bench.h"
+#include "drm.h"
+#include "va.h"
+
+extern struct kmsvnc_data *kmsvnc;
+
+#define BENCH_WIDTH 1920
+#define BENCH_HEIGHT 1080
+#define BENCH_ROUNDS 20
+
+// the per pixel detiler that shipped before detile_x(), kept as the reference
+static void bench_reference_x_tiled(const int tilex, const int tiley, const char *in, int width, int height, char *buff)
+{
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            int sno = (x / tilex) + (y / tiley) * (width / tilex);
+            int ord = (x % tilex) + (y % tiley) * tilex;
+            int offset = sno * tilex * tiley + ord;
+            memcpy(buff + (x + y * width) * 4, in + offset * 4, 4);
+        }
+    }
+    for (int i = 0; i < width * height * BYTES_PER_PIXEL; i += BYTES_PER_PIXEL) {
+        uint32_t pixdata = htonl(*((uint32_t*)(buff + i)));
+        buff[i+0] = (pixdata & 0x0000ff00) >> 8;
+        buff[i+2] = (pixdata & 0xff000000) >> 24;
+    }
+}
+
+static void bench_reference_nvidia(const char *in, int width, int height, int pitch, char *buff) {
+    bench_reference_x_tiled(16, 128, in, width, height, buff);
+}
+
+static void bench_reference_intel(const char *in, int width, int height, int pitch, char *buff) {
+    bench_reference_x_tiled(128, 8, in, width, height, buff);
+}
+
+// the reference also swaps red and blue, do the same to compare
+static void bench_detile_nvidia(const char *in, int width, int height, int pitch, char *buff) {
+    detile_nvidia_x(in, width, height, pitch, buff, kmsvnc->simd->swap_rb);
+}
+
+static void bench_detile_intel(const char *in, int width, int height, int pitch, char *buff) {
+    detile_intel_x(in, width, height, pitch, buff, kmsvnc->simd->swap_rb);
+}
+
+static const struct {
+    const char *name;
+    int tilex;
+    int tiley;
+    void (*reference)(const char *, int, int, int, char *);
+    void (*convert)(const char *, int, int, int, char *);
+} bench_detilers[] = {
+    {"nvidia x-tiled", 16, 128, bench_reference_nvidia, bench_detile_nvidia},
+    {"intel x-tiled", 128, 8, bench_reference_intel, bench_detile_intel},
+};
+
+static double bench_time(void (*convert)(const char *, int, int, int, char *), const char *in, int pitch, char *out) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < BENCH_ROUNDS; i++) {
+        convert(in, BENCH_WIDTH, BENCH_HEIGHT, pitch, out);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return ((end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6) / BENCH_ROUNDS;
+}
+
+static const VAImageFormat *bench_va_fmt;
+static struct kmsvnc_va_convert bench_va_plan;
+
+// the multi pass conversion that shipped before va_convert(), kept as the reference
+static void bench_reference_vaapi(const char *in, int width, int height, int pitch, char *buff) {
+    for (int y = 0; y < height; y++) {
+        memcpy(buff + y * width * BYTES_PER_PIXEL, in + y * pitch, width * BYTES_PER_PIXEL);
+    }
+    if (
+        (KMSVNC_FOURCC_TO_INT('R','G','B',0) & bench_va_fmt->fourcc) == KMSVNC_FOURCC_TO_INT('R','G','B',0)
+    ) {}
+    else {
+        // is 30 depth?
+        if (bench_va_fmt->depth == 30) {
+            for (int i = 0; i < width * height * BYTES_PER_PIXEL; i += BYTES_PER_PIXEL) {
+                // ensure little endianess
+                uint32_t pixdata = __builtin_bswap32(htonl(*((uint32_t*)(buff + i))));
+                buff[i] = (pixdata & 0x3ff00000) >> 20 >> 2;
+                buff[i+1] = (pixdata & 0xffc00) >> 10 >> 2;
+                buff[i+2] = (pixdata & 0x3ff) >> 2;
+            }
+        }
+        else {
+            if (!bench_va_fmt->byte_order) {
+                for (int i = 0; i < width * height * BYTES_PER_PIXEL; i += BYTES_PER_PIXEL) {
+                    uint32_t *pixdata = (uint32_t*)(buff + i);
+                    *pixdata = __builtin_bswap32(*pixdata);
+                }
+            }
+        }
+        // is xrgb?
+        if ((bench_va_fmt->blue_mask | bench_va_fmt->red_mask) < 0x1000000) {
+            for (int i = 0; i < width * height * BYTES_PER_PIXEL; i += BYTES_PER_PIXEL) {
+                uint32_t *pixdata = (uint32_t*)(buff + i);
+                *pixdata = ntohl(htonl(*pixdata) << 8);
+            }
+        }
+        // is bgrx?
+        if (bench_va_fmt->blue_mask > bench_va_fmt->red_mask) {
+            for (int i = 0; i < width * height * BYTES_PER_PIXEL; i += BYTES_PER_PIXEL) {
+                uint32_t pixdata = htonl(*((uint32_t*)(buff + i)));
+                buff[i+0] = (pixdata & 0x0000ff00) >> 8;
+                buff[i+2] = (pixdata & 0xff000000) >> 24;
+            }
+        }
+    }
+}
+
+static void bench_convert_vaapi(const char *in, int width, int height, int pitch, char *buff) {
+    va_convert_image(&bench_va_plan, buff, in, width, height, pitch);
+}
+
+// builds the image format a driver would report for a fourcc in the given byte order
+static void bench_va_format(uint32_t fourcc, uint32_t depth, uint32_t byte_order, VAImageFormat *fmt) {
+    memset(fmt, 0, sizeof(*fmt));
+    fmt->fourcc = fourcc;
+    fmt->byte_order = byte_order;
+    fmt->bits_per_pixel = 32;
+    fmt->depth = depth;
+    if (depth == 30) {
+        uint32_t hi = 0x3ff00000, lo = 0x3ff;
+        char bgr = (fourcc >> 8 & 0xff) == 'B';
+        fmt->red_mask = bgr ? lo : hi;
+        fmt->green_mask = 0xffc00;
+        fmt->blue_mask = bgr ? hi : lo;
+        return;
+    }
+    for (int i = 0; i < 4; i++) {
+        char c = fourcc >> (8 * i) & 0xff;
+        uint32_t mask = 0xffu << (byte_order == VA_LSB_FIRST ? 8 * i : 8 * (3 - i));
+        if (c == 'R') fmt->red_mask = mask;
+        else if (c == 'G') fmt->green_mask = mask;
+        else if (c == 'B') fmt->blue_mask = mask;
+        else if (c == 'A') fmt->alpha_mask = mask;
+    }
+}
+
+static int bench_vaapi(char *expected, char *actual) {
+    int failed = 0;
+    int pitch = BENCH_WIDTH * BYTES_PER_PIXEL + 256;
+    size_t in_len = (size_t)pitch * BENCH_HEIGHT;
+    size_t out_len = BENCH_WIDTH * BENCH_HEIGHT * BYTES_PER_PIXEL;
+    char *in = malloc(in_len);
+    if (!in) return 1;
+    srand(0x5641);
+    for (size_t j = 0; j < in_len; j++) in[j] = rand();
+
+    for (int i = 0; i < va_formats_to_try_len; i++) {
+        for (uint32_t byte_order = VA_LSB_FIRST; byte_order <= VA_MSB_FIRST; byte_order++) {
+            if (va_formats_to_try[i].depth == 30 && byte_order != VA_LSB_FIRST) continue;
+            VAImageFormat fmt;
+            bench_va_format(va_formats_to_try[i].va_fourcc, va_formats_to_try[i].depth, byte_order, &fmt);
+            bench_va_fmt = &fmt;
+            va_plan_convert(&fmt, &bench_va_plan);
+
+            bench_reference_vaapi(in, BENCH_WIDTH, BENCH_HEIGHT, pitch, expected);
+            memset(actual, 0, out_len);
+            bench_convert_vaapi(in, BENCH_WIDTH, BENCH_HEIGHT, pitch, actual);
+            char ok = !memcmp(expected, actual, out_len);
+            if (!ok) failed = 1;
+
+            double reference_ms = bench_time(bench_reference_vaapi, in, pitch, expected);
+            double convert_ms = bench_time(bench_convert_vaapi, in, pitch, actual);
+            char name[32];
+            snprintf(name, sizeof(name), "vaapi %.4s %s", (char*)&fmt.fourcc, byte_order == VA_LSB_FIRST ? "lsb" : "msb");
+            printf("%-16s %s  reference %7.3f ms  %s %7.3f ms  %5.1fx\n", name, ok ? "ok      " : "MISMATCH",
+                reference_ms, bench_va_plan.identity ? "memcpy" : bench_va_plan.bytewise && kmsvnc->simd->shuffle ? "shuffle" : "unpack",
+                convert_ms, reference_ms / convert_ms);
+        }
+    }
+    free(in);
+    return failed;
+}
+
+static const struct {
+    const char *name;
+    uint64_t modifier;
+    // where every bit of the byte offset in a tile comes from, lowest first, x counts bytes
+    const char *bits;
+} bench_swizzles[] = {
+    {"intel y-tiled", I915_FORMAT_MOD_Y_TILED, "x0x1x2x3y0y1y2y3y4x4x5x6"},
+    {"intel tile4", I915_FORMAT_MOD_4_TILED, "x0x1x2x3y0y1x4x5y2x6y3y4"},
+    {"amd 64k_s", AMD_FMT_MOD | AMD_FMT_MOD_SET(TILE_VERSION, AMD_FMT_MOD_TILE_VERSION_GFX9) | AMD_FMT_MOD_SET(TILE, AMD_FMT_MOD_TILE_GFX9_64K_S),
+        "x0x1x2x3y0y1x4y2x5y3x6y4x7y5x8y6"},
+};
+
+static struct kmsvnc_drm_swizzle bench_swizzle;
+static const char *bench_swizzle_bits;
+
+// scatters the bits of x and y as listed in bench_swizzle_bits
+static size_t bench_reference_offset(int x, int y) {
+    size_t offset = 0;
+    for (int i = 0; bench_swizzle_bits[2 * i]; i++) {
+        int v = bench_swizzle_bits[2 * i] == 'x' ? x : y;
+        offset |= (size_t)(v >> (bench_swizzle_bits[2 * i + 1] - '0') & 1) << i;
+    }
+    return offset;
+}
+
+// one pixel at a time straight from the bit layout
+static void bench_reference_swizzled(const char *in, int width, int height, int pitch, char *buff) {
+    int tile_row = bench_swizzle.tile_w * BYTES_PER_PIXEL;
+    size_t tile_size = (size_t)tile_row * bench_swizzle.tile_h;
+    int tiles_per_row = pitch / tile_row;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            int tx = x / bench_swizzle.tile_w;
+            int ty = y / bench_swizzle.tile_h;
+            size_t offset = ((size_t)ty * tiles_per_row + tx) * tile_size +
+                bench_reference_offset(x % bench_swizzle.tile_w * BYTES_PER_PIXEL, y % bench_swizzle.tile_h);
+            memcpy(buff + ((size_t)y * width + x) * BYTES_PER_PIXEL, in + offset, BYTES_PER_PIXEL);
+        }
+    }
+}
+
+static void bench_detile_swizzled(const char *in, int width, int height, int pitch, char *buff) {
+    detile_swizzled(&bench_swizzle, in, width, height, pitch, buff);
+}
+
+static int bench_swizzled(char *expected, char *actual) {
+    int failed = 0;
+    size_t out_len = BENCH_WIDTH * BENCH_HEIGHT * BYTES_PER_PIXEL;
+    for (int i = 0; i < KMSVNC_ARRAY_ELEMENTS(bench_swizzles); i++) {
+        if (drm_swizzle_setup(bench_swizzles[i].modifier, &bench_swizzle)) {
+            printf("%-16s MISMATCH  no detiler for the modifier\n", bench_swizzles[i].name);
+            failed = 1;
+            continue;
+        }
+        bench_swizzle_bits = bench_swizzles[i].bits;
+        int tile_w = bench_swizzle.tile_w;
+        int tile_h = bench_swizzle.tile_h;
+        int pitch = (BENCH_WIDTH + tile_w - 1) / tile_w * tile_w * BYTES_PER_PIXEL;
+        size_t in_len = (size_t)pitch * ((BENCH_HEIGHT + tile_h - 1) / tile_h * tile_h);
+        char *in = malloc(in_len);
+        if (!in) {
+            drm_swizzle_cleanup(&bench_swizzle);
+            return 1;
+        }
+        srand(0x5357 + i);
+        for (size_t j = 0; j < in_len; j++) in[j] = rand();
+
+        bench_reference_swizzled(in, BENCH_WIDTH, BENCH_HEIGHT, pitch, expected);
+        memset(actual, 0, out_len);
+        bench_detile_swizzled(in, BENCH_WIDTH, BENCH_HEIGHT, pitch, actual);
+        char ok = !memcmp(expected, actual, out_len);
+        if (!ok) failed = 1;
+
+        double reference_ms = bench_time(bench_reference_swizzled, in, pitch, expected);
+        double convert_ms = bench_time(bench_detile_swizzled, in, pitch, actual);
+        printf("%-16s %s  reference %7.3f ms  %s %7.3f ms  %5.1fx\n", bench_swizzles[i].name, ok ? "ok      " : "MISMATCH",
+            reference_ms, "spans", convert_ms, reference_ms / convert_ms);
+        free(in);
+        drm_swizzle_cleanup(&bench_swizzle);
+    }
+    return failed;
+}
+
+// the per pixel scan that shipped before alpha_span, buff gets min_x, min_y, max_x and max_y
+static void bench_reference_alpha_bbox(const char *in, int width, int height, int pitch, char *buff) {
+    int *box = (int*)buff;
+    box[0] = width;
+    box[1] = height;
+    box[2] = -1;
+    box[3] = -1;
+    for (int i = 0; i < width * height * BYTES_PER_PIXEL; i += BYTES_PER_PIXEL) {
+        uint8_t a = htonl(*((uint32_t*)(in + i))) & 0xff;
+        if (a > CURSOR_MIN_A) {
+            int x = (i / BYTES_PER_PIXEL) % width;
+            int y = (i / BYTES_PER_PIXEL) / width;
+            if (x < box[0]) box[0] = x;
+            if (y < box[1]) box[1] = y;
+            if (x > box[2]) box[2] = x;
+            if (y > box[3]) box[3] = y;
+        }
+    }
+}
+
+static void bench_alpha_bbox(const char *in, int width, int height, int pitch, char *buff) {
+    int *box = (int*)buff;
+    box[0] = width;
+    box[1] = height;
+    box[2] = -1;
+    box[3] = -1;
+    for (int y = 0; y < height; y++) {
+        int first, last;
+        if (!kmsvnc->simd->alpha_span(in + (size_t)y * pitch, width * BYTES_PER_PIXEL, CURSOR_MIN_A, &first, &last)) continue;
+        if (first < box[0]) box[0] = first;
+        if (y < box[1]) box[1] = y;
+        if (last > box[2]) box[2] = last;
+        box[3] = y;
+    }
+}
+
+// a mostly transparent frame with an opaque box, like a cursor plane but larger
+static int bench_cursor(char *expected, char *actual) {
+    int failed = 0;
+    int pitch = BENCH_WIDTH * BYTES_PER_PIXEL;
+    char *in = malloc((size_t)pitch * BENCH_HEIGHT);
+    if (!in) return 1;
+    for (int i = 0; i < 8; i++) {
+        srand(0xc0 + i);
+        for (size_t j = 0; j < (size_t)pitch * BENCH_HEIGHT; j++) {
+            in[j] = j % BYTES_PER_PIXEL == 3 ? rand() % (CURSOR_MIN_A + 1) : rand();
+        }
+        int x1 = rand() % BENCH_WIDTH, x2 = x1 + rand() % (BENCH_WIDTH - x1);
+        int y1 = rand() % BENCH_HEIGHT, y2 = y1 + rand() % (BENCH_HEIGHT - y1);
+        for (int y = y1; y <= y2; y += 1 + rand() % 8) {
+            for (int x = x1; x <= x2; x += 1 + rand() % 64) in[(size_t)y * pitch + x * BYTES_PER_PIXEL + 3] = 0xff;
+        }
+        in[(size_t)y1 * pitch + x1 * BYTES_PER_PIXEL + 3] = 0xff;
+        in[(size_t)y2 * pitch + x2 * BYTES_PER_PIXEL + 3] = 0xff;
+
+        bench_reference_alpha_bbox(in, BENCH_WIDTH, BENCH_HEIGHT, pitch, expected);
+        bench_alpha_bbox(in, BENCH_WIDTH, BENCH_HEIGHT, pitch, actual);
+        if (memcmp(expected, actual, sizeof(int) * 4)) failed = 1;
+    }
+    double reference_ms = bench_time(bench_reference_alpha_bbox, in, pitch, expected);
+    double convert_ms = bench_time(bench_alpha_bbox, in, pitch, actual);
+    printf("%-16s %s  reference %7.3f ms  %s %7.3f ms  %5.1fx\n", "alpha bbox", failed ? "MISMATCH" : "ok      ",
+        reference_ms, kmsvnc->simd->name, convert_ms, reference_ms / convert_ms);
+    free(in);
+    return failed;
+}
+
+// checks the detilers and image conversions against the reference and times both, returns non-zero on a mismatch
+int bench_run() {
+    int failed = 0;
+    size_t out_len = BENCH_WIDTH * BENCH_HEIGHT * BYTES_PER_PIXEL;
+    char *expected = malloc(out_len);
+    char *actual = malloc(out_len);
+    if (!expected || !actual) {
+        free(expected);
+        free(actual);
+        KMSVNC_FATAL("memory allocation error at %s:%d\n", __FILE__, __LINE__);
+    }
+
+    for (int i = 0; i < KMSVNC_ARRAY_ELEMENTS(bench_detilers); i++) {
+        int tilex = bench_detilers[i].tilex;
+        int tiley = bench_detilers[i].tiley;
+        int pitch = BENCH_WIDTH / tilex * tilex * BYTES_PER_PIXEL;
+        size_t in_len = (size_t)pitch * ((BENCH_HEIGHT + tiley - 1) / tiley) * tiley;
+        char *in = malloc(in_len);
+        if (!in) {
+            free(expected);
+            free(actual);
+            KMSVNC_FATAL("memory allocation error at %s:%d\n", __FILE__, __LINE__);
+        }
+        srand(i + 1);
+        for (size_t j = 0; j < in_len; j++) in[j] = rand();
+
+        bench_detilers[i].reference(in, BENCH_WIDTH, BENCH_HEIGHT, pitch, expected);
+        memset(actual, 0, out_len);
+        bench_detilers[i].convert(in, BENCH_WIDTH, BENCH_HEIGHT, pitch, actual);
+        char ok = !memcmp(expected, actual, out_len);
+        if (!ok) failed = 1;
+
+        double reference_ms = bench_time(bench_detilers[i].reference, in, pitch, expected);
+        double convert_ms = bench_time(bench_detilers[i].convert, in, pitch, actual);
+        printf("%-16s %s  reference %7.3f ms  %s %7.3f ms  %5.1fx\n", bench_detilers[i].name, ok ? "ok      " : "MISMATCH",
+            reference_ms, kmsvnc->simd->name, convert_ms, reference_ms / convert_ms);
+        free(in);
+    }
+    if (bench_swizzled(expected, actual)) failed = 1;
+    if (bench_vaapi(expected, actual)) failed = 1;
+    if (bench_cursor(expected, actual)) failed = 1;
+
+    free(expected);
+    free(actual);
+    return failed;
+}
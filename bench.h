@@ -0,0 +1,5 @@
+#pragma once
+
+#include "kmsvnc.h"
+
+int bench_run();
@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cursor.h"
+#include "drm.h"
+#include "idle.h"
+
+extern struct kmsvnc_data *kmsvnc;
+
+#define CURSOR_HASH_PRIME 0x100000001b3ull
+
+static void cursor_shape_release(struct kmsvnc_cursor_shape *shape) {
+    if (shape->cursor) {
+        // rfbFreeCursor() only frees the struct itself with cleanup set
+        shape->cursor->cleanup = TRUE;
+        rfbFreeCursor(shape->cursor);
+    }
+    if (shape->bitmap) {
+        free(shape->bitmap);
+    }
+    memset(shape, 0, sizeof(struct kmsvnc_cursor_shape));
+}
+
+void cursor_cleanup() {
+    if (kmsvnc->cursor) {
+        struct kmsvnc_cursor_data *cursor = kmsvnc->cursor;
+        for (int i = 0; i < cursor->shape_count; i++) {
+            cursor_shape_release(cursor->shapes + i);
+        }
+        cursor->shape_count = 0;
+        cursor->current = NULL;
+        if (cursor->bitmap) {
+            free(cursor->bitmap);
+            cursor->bitmap = NULL;
+        }
+        cursor->bitmap_len = 0;
+        if (cursor->strings) {
+            free(cursor->strings);
+            cursor->strings = NULL;
+        }
+        cursor->strings_len = 0;
+        free(kmsvnc->cursor);
+        kmsvnc->cursor = NULL;
+    }
+}
+
+int cursor_init() {
+    struct kmsvnc_cursor_data *cursor = malloc(sizeof(struct kmsvnc_cursor_data));
+    if (!cursor) KMSVNC_FATAL("memory allocation error at %s:%d\n", __FILE__, __LINE__);
+    memset(cursor, 0, sizeof(struct kmsvnc_cursor_data));
+    kmsvnc->cursor = cursor;
+    return 0;
+}
+
+static int cursor_reserve(char **buf, size_t *buf_len, size_t len) {
+    if (*buf_len >= len) return 0;
+    char *grown = realloc(*buf, len);
+    if (!grown) return 1;
+    *buf = grown;
+    *buf_len = len;
+    return 0;
+}
+
+static uint64_t cursor_hash(const char *bitmap, int width, int height) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    h = (h ^ (uint32_t)width) * CURSOR_HASH_PRIME;
+    h = (h ^ (uint32_t)height) * CURSOR_HASH_PRIME;
+    const uint32_t *p = (const uint32_t *)bitmap;
+    for (size_t i = 0; i < (size_t)width * height; i++) {
+        h = (h ^ p[i]) * CURSOR_HASH_PRIME;
+    }
+    return h;
+}
+
+static char cursor_shape_matches(const struct kmsvnc_cursor_shape *shape, uint64_t hash, int width, int height) {
+    return shape->hash == hash && shape->width == width && shape->height == height &&
+        !memcmp(shape->bitmap, kmsvnc->cursor->bitmap, (size_t)width * height * BYTES_PER_PIXEL);
+}
+
+// turns the cropped bitmap into a cursor, replacing the least recently used shape that is not shown
+static struct kmsvnc_cursor_shape *cursor_shape_build(uint64_t hash, int width, int height) {
+    struct kmsvnc_cursor_data *cursor = kmsvnc->cursor;
+    size_t pixels = (size_t)width * height;
+
+    if (cursor_reserve(&cursor->strings, &cursor->strings_len, pixels * 2)) return NULL;
+    char *cursorString = cursor->strings;
+    char *maskString = cursor->strings + pixels;
+    memset(cursorString, 'x', pixels);
+    for (size_t i = 0; i < pixels; i++) {
+        maskString[i] = (uint8_t)cursor->bitmap[i * BYTES_PER_PIXEL + 3] > CURSOR_MIN_A ? 'x' : ' ';
+    }
+
+    char *bitmap = malloc(pixels * BYTES_PER_PIXEL);
+    if (!bitmap) return NULL;
+    unsigned char *rich_source = malloc(pixels * BYTES_PER_PIXEL);
+    if (!rich_source) {
+        free(bitmap);
+        return NULL;
+    }
+    memcpy(bitmap, cursor->bitmap, pixels * BYTES_PER_PIXEL);
+    memcpy(rich_source, cursor->bitmap, pixels * BYTES_PER_PIXEL);
+    if (kmsvnc->bytes_per_pixel == 2) {
+        // rich cursors are in the server pixel format, pack in place
+        static const uint8_t rgbx[4] = {0, 8, 16, 32}, bgrx[4] = {16, 8, 0, 32};
+        kmsvnc->simd->pack565((char*)rich_source, (char*)rich_source, pixels * BYTES_PER_PIXEL, kmsvnc->drm->server_bgrx ? bgrx : rgbx);
+    }
+
+    // rfbMakeXCursor() only reads the strings
+    rfbCursorPtr c = rfbMakeXCursor(width, height, cursorString, maskString);
+    if (!c) {
+        free(bitmap);
+        free(rich_source);
+        return NULL;
+    }
+    c->richSource = rich_source;
+    c->cleanupRichSource = TRUE;
+    if (kmsvnc->composite_cursor) {
+        // libvncserver draws the cursor into updates for clients without cursor shape support,
+        // with an alpha source it blends every pixel instead of copying those under the mask
+        unsigned char *alpha = malloc(pixels);
+        if (alpha) {
+            for (size_t i = 0; i < pixels; i++) {
+                alpha[i] = cursor->bitmap[i * BYTES_PER_PIXEL + 3];
+            }
+            // cursor planes blend premultiplied unless told otherwise
+            c->alphaSource = alpha;
+            c->alphaPreMultiplied = TRUE;
+        }
+    }
+    c->cleanup = FALSE;
+    c->xhot = 0;
+    c->yhot = 0;
+
+    struct kmsvnc_cursor_shape *shape;
+    if (cursor->shape_count < CURSOR_CACHE_SIZE) {
+        shape = cursor->shapes + cursor->shape_count++;
+    }
+    else {
+        shape = NULL;
+        for (int i = 0; i < CURSOR_CACHE_SIZE; i++) {
+            if (cursor->shapes + i == cursor->current) continue;
+            if (!shape || cursor->shapes[i].last_used < shape->last_used) shape = cursor->shapes + i;
+        }
+        cursor_shape_release(shape);
+    }
+    shape->hash = hash;
+    shape->width = width;
+    shape->height = height;
+    shape->bitmap = bitmap;
+    shape->cursor = c;
+    return shape;
+}
+
+// data is the whole cursor plane, the cursor sent is cropped to the pixels that are mostly opaque
+void cursor_update(const char *data, int width, int height) {
+    struct kmsvnc_cursor_data *cursor = kmsvnc->cursor;
+    int min_x = width;
+    int max_x = -1;
+    int min_y = height;
+    int max_y = -1;
+
+    for (int y = 0; y < height; y++) {
+        int first, last;
+        if (!kmsvnc->simd->alpha_span(data + (size_t)y * width * BYTES_PER_PIXEL, width * BYTES_PER_PIXEL, CURSOR_MIN_A, &first, &last)) continue;
+        if (first < min_x) min_x = first;
+        if (last > max_x) max_x = last;
+        if (y < min_y) min_y = y;
+        max_y = y;
+    }
+    if (min_x > max_x || min_y > max_y) {
+        // no cursor detected
+        return;
+    }
+    int rwidth = max_x - min_x + 1;
+    int rheight = max_y - min_y + 1;
+    cursor->offx = min_x;
+    cursor->offy = min_y;
+
+    if (cursor_reserve(&cursor->bitmap, &cursor->bitmap_len, (size_t)rwidth * rheight * BYTES_PER_PIXEL)) return;
+    for (int j = 0; j < rheight; j++) {
+        memcpy(cursor->bitmap + (size_t)j * rwidth * BYTES_PER_PIXEL, data + ((size_t)(j + min_y) * width + min_x) * BYTES_PER_PIXEL, rwidth * BYTES_PER_PIXEL);
+    }
+    uint64_t hash = cursor_hash(cursor->bitmap, rwidth, rheight);
+
+    cursor->clock++;
+    if (cursor->current && cursor_shape_matches(cursor->current, hash, rwidth, rheight)) {
+        cursor->current->last_used = cursor->clock;
+        return;
+    }
+    struct kmsvnc_cursor_shape *shape = NULL;
+    for (int i = 0; i < cursor->shape_count; i++) {
+        if (cursor_shape_matches(cursor->shapes + i, hash, rwidth, rheight)) {
+            shape = cursor->shapes + i;
+            break;
+        }
+    }
+    KMSVNC_DEBUG("cursor update %dx%d%s\n", rwidth, rheight, shape ? ", cached" : "");
+    if (!shape) shape = cursor_shape_build(hash, rwidth, rheight);
+    if (!shape) return;
+    shape->last_used = cursor->clock;
+    cursor->current = shape;
+    rfbSetCursor(kmsvnc->server, shape->cursor);
+}
+
+static void cursor_mark_rect(rfbClientPtr cl, int x, int y, int width, int height) {
+    int x2 = x + width < kmsvnc->server->width ? x + width : kmsvnc->server->width;
+    int y2 = y + height < kmsvnc->server->height ? y + height : kmsvnc->server->height;
+    if (x2 <= x || y2 <= y) return;
+    sraRegionPtr region = sraRgnCreateRect(x, y, x2, y2);
+    LOCK(cl->updateMutex);
+    sraRgnOr(cl->modifiedRegion, region);
+    TSIGNAL(cl->updateCond);
+    UNLOCK(cl->updateMutex);
+    sraRgnDestroy(region);
+}
+
+// pointer motion becomes a PointerPos pseudo-encoding for clients that asked for it,
+// instead of a framebuffer update around the cursor
+void cursor_update_pos() {
+    int x, y;
+    if (drm_cursor_position(&x, &y)) return;
+    // the hotspot of the cropped rich cursor is its top left corner
+    x += kmsvnc->cursor->offx;
+    y += kmsvnc->cursor->offy;
+    if (x < 0) x = 0;
+    if (y < 0) y = 0;
+    if (x >= kmsvnc->server->width) x = kmsvnc->server->width - 1;
+    if (y >= kmsvnc->server->height) y = kmsvnc->server->height - 1;
+    if (x == kmsvnc->server->cursorX && y == kmsvnc->server->cursorY) return;
+
+    LOCK(kmsvnc->server->cursorMutex);
+    kmsvnc->server->cursorX = x;
+    kmsvnc->server->cursorY = y;
+    UNLOCK(kmsvnc->server->cursorMutex);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t since_pointer = (int64_t)now.tv_sec * 1000000000ll + now.tv_nsec - __atomic_load_n(&kmsvnc->pointer_time_ns, __ATOMIC_RELAXED);
+    rfbClientPtr pointer_client = __atomic_load_n(&kmsvnc->pointer_client, __ATOMIC_RELAXED);
+    rfbClientIteratorPtr iter = rfbGetClientIterator(kmsvnc->server);
+    rfbClientPtr cl;
+    while ((cl = rfbClientIteratorNext(iter))) {
+        if (!cl->enableCursorShapeUpdates && kmsvnc->composite_cursor && kmsvnc->cursor->current) {
+            // libvncserver redraws the old and new cursor rects itself, but only once an update is
+            // pending, on a still screen nothing else would queue one for this client
+            cursor_mark_rect(cl, x, y, 1, 1);
+        }
+        if (!cl->enableCursorPosUpdates) continue;
+        // the pointer is following this client, sending its own motion back makes the local cursor jitter
+        if (cl == pointer_client && since_pointer < CURSOR_POINTER_ECHO_NS) continue;
+        LOCK(cl->updateMutex);
+        cl->cursorWasMoved = TRUE;
+        TSIGNAL(cl->updateCond);
+        UNLOCK(cl->updateMutex);
+    }
+    rfbReleaseClientIterator(iter);
+    idle_frame(1);
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "kmsvnc.h"
+
+void cursor_cleanup();
+int cursor_init();
+void cursor_update(const char *data, int width, int height);
+void cursor_update_pos();
@@ -0,0 +1,313 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "damage.h"
+
+extern struct kmsvnc_data *kmsvnc;
+
+void damage_cleanup() {
+    if (kmsvnc->damage) {
+        if (kmsvnc->damage->tiles) {
+            free(kmsvnc->damage->tiles);
+            kmsvnc->damage->tiles = NULL;
+        }
+        if (kmsvnc->damage->hints) {
+            free(kmsvnc->damage->hints);
+            kmsvnc->damage->hints = NULL;
+        }
+        if (kmsvnc->damage->rects) {
+            free(kmsvnc->damage->rects);
+            kmsvnc->damage->rects = NULL;
+        }
+        if (kmsvnc->damage->active) {
+            free(kmsvnc->damage->active);
+            kmsvnc->damage->active = NULL;
+        }
+        free(kmsvnc->damage);
+        kmsvnc->damage = NULL;
+    }
+}
+
+int damage_init(int width, int height) {
+    struct kmsvnc_damage_data *damage = malloc(sizeof(struct kmsvnc_damage_data));
+    if (!damage) KMSVNC_FATAL("memory allocation error at %s:%d\n", __FILE__, __LINE__);
+    memset(damage, 0, sizeof(struct kmsvnc_damage_data));
+    kmsvnc->damage = damage;
+
+    damage->tiles_x = (width + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE;
+    damage->tiles_y = (height + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE;
+    int tile_count = damage->tiles_x * damage->tiles_y;
+
+    damage->tiles = malloc(tile_count);
+    if (!damage->tiles) KMSVNC_FATAL("memory allocation error at %s:%d\n", __FILE__, __LINE__);
+    memset(damage->tiles, 0, tile_count);
+    damage->hints = malloc(tile_count);
+    if (!damage->hints) KMSVNC_FATAL("memory allocation error at %s:%d\n", __FILE__, __LINE__);
+    memset(damage->hints, 1, tile_count);
+    // worst case is a checkerboard, one rect per tile
+    damage->rects = malloc(sizeof(struct kmsvnc_damage_rect) * tile_count);
+    if (!damage->rects) KMSVNC_FATAL("memory allocation error at %s:%d\n", __FILE__, __LINE__);
+    // rects still open on the previous tile row, and the ones being built on the current row
+    damage->active = malloc(sizeof(int) * damage->tiles_x * 2);
+    if (!damage->active) KMSVNC_FATAL("memory allocation error at %s:%d\n", __FILE__, __LINE__);
+    return 0;
+}
+
+void damage_clear() {
+    memset(kmsvnc->damage->tiles, 0, kmsvnc->damage->tiles_x * kmsvnc->damage->tiles_y);
+}
+
+// marks the tiles covering a rect in pixels, safe to call from several capture threads
+void damage_mark_rect(int x1, int y1, int x2, int y2) {
+    struct kmsvnc_damage_data *damage = kmsvnc->damage;
+    for (int ty = y1 / DAMAGE_TILE_SIZE; ty <= (y2 - 1) / DAMAGE_TILE_SIZE; ty++) {
+        for (int tx = x1 / DAMAGE_TILE_SIZE; tx <= (x2 - 1) / DAMAGE_TILE_SIZE; tx++) {
+            __atomic_store_n(damage->tiles + ty * damage->tiles_x + tx, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// decide once per frame whether damage_probe() samples or hints every tile
+void damage_probe_begin(char force_sweep) {
+    struct kmsvnc_damage_data *damage = kmsvnc->damage;
+    damage->probe_phase++;
+    if (force_sweep || ++damage->probe_frames >= kmsvnc->vnc_opt->probe_sweep) {
+        damage->probe_frames = 0;
+        damage->probe_sweep = 1;
+    }
+    else {
+        damage->probe_sweep = 0;
+    }
+}
+
+// converts a few rows of every tile in tile row ty from src and compares them against ref,
+// the rows rotate every frame so a static screen is fully sampled after a while
+// tiles that differ are hinted for damage_convert() and damage_update()
+// src has src_bpp bytes per pixel and rows src_pitch apart, conv and ref are in the server layout
+// returns the number of hinted tiles in the row
+int damage_probe(const char *src, size_t src_pitch, int src_bpp, char *conv, const char *ref, int width, int height, int ty, void (*convert)(const char *, int, int, char *)) {
+    struct kmsvnc_damage_data *damage = kmsvnc->damage;
+    const int bpp = kmsvnc->bytes_per_pixel;
+    size_t stride = width * bpp;
+    char *hints = damage->hints + ty * damage->tiles_x;
+
+    if (damage->probe_sweep) {
+        memset(hints, 1, damage->tiles_x);
+        return damage->tiles_x;
+    }
+    memset(hints, 0, damage->tiles_x);
+    int y0 = ty * DAMAGE_TILE_SIZE;
+    int rows = height - y0 < DAMAGE_TILE_SIZE ? height - y0 : DAMAGE_TILE_SIZE;
+    int step = DAMAGE_TILE_SIZE / DAMAGE_PROBE_ROWS;
+    int hinted = 0;
+    for (int k = 0; k < DAMAGE_PROBE_ROWS && hinted < damage->tiles_x; k++) {
+        int y = y0 + (damage->probe_phase + k * step) % rows;
+        size_t offset = y * stride;
+        // rows are converted whole, tiles already hinted will be converted again anyway
+        convert(src + (size_t)y * src_pitch, width, 1, conv + offset);
+        for (int tx = 0; tx < damage->tiles_x; tx++) {
+            if (hints[tx]) continue;
+            int x = tx * DAMAGE_TILE_SIZE;
+            int w = width - x < DAMAGE_TILE_SIZE ? width - x : DAMAGE_TILE_SIZE;
+            if (kmsvnc->simd->cmp(conv + offset + x * bpp, ref + offset + x * bpp, w * bpp)) {
+                hints[tx] = 1;
+                hinted++;
+            }
+        }
+    }
+    return hinted;
+}
+
+// converts the hinted tiles of tile row ty from src into dst
+void damage_convert(const char *src, size_t src_pitch, int src_bpp, char *dst, int width, int height, int ty, void (*convert)(const char *, int, int, char *)) {
+    struct kmsvnc_damage_data *damage = kmsvnc->damage;
+    const int bpp = kmsvnc->bytes_per_pixel;
+    size_t stride = width * bpp;
+    char *hints = damage->hints + ty * damage->tiles_x;
+    int y0 = ty * DAMAGE_TILE_SIZE;
+    int rows = height - y0 < DAMAGE_TILE_SIZE ? height - y0 : DAMAGE_TILE_SIZE;
+
+    int tx = 0;
+    while (tx < damage->tiles_x) {
+        if (!hints[tx]) {
+            tx++;
+            continue;
+        }
+        int start = tx;
+        while (tx < damage->tiles_x && hints[tx]) tx++;
+        int x = start * DAMAGE_TILE_SIZE;
+        int x_end = tx * DAMAGE_TILE_SIZE;
+        if (x_end > width) x_end = width;
+        if (x == 0 && x_end == width) {
+            convert(src + (size_t)y0 * src_pitch, width, rows, dst + y0 * stride);
+            continue;
+        }
+        for (int y = y0; y < y0 + rows; y++) {
+            size_t offset = (size_t)y * width + x;
+            convert(src + (size_t)y * src_pitch + (size_t)x * src_bpp, x_end - x, 1, dst + offset * bpp);
+        }
+    }
+}
+
+// compares tile row ty of new against old and copies the changed spans into old in the same pass
+// only tiles hinted by damage_probe() are looked at when probing
+// returns the number of dirty tiles in the row
+int damage_update(char *old, const char *new, int width, int height, int ty, char probing) {
+    struct kmsvnc_damage_data *damage = kmsvnc->damage;
+    const int bpp = kmsvnc->bytes_per_pixel;
+    size_t stride = width * bpp;
+    char *tiles = damage->tiles + ty * damage->tiles_x;
+    char *hints = damage->hints + ty * damage->tiles_x;
+    int dirty = 0;
+
+    memset(tiles, 0, damage->tiles_x);
+    int y_end = (ty + 1) * DAMAGE_TILE_SIZE;
+    if (y_end > height) y_end = height;
+    for (int y = ty * DAMAGE_TILE_SIZE; y < y_end; y++) {
+        for (int tx = 0; tx < damage->tiles_x; tx++) {
+            if (probing && !hints[tx]) continue;
+            int x = tx * DAMAGE_TILE_SIZE;
+            int w = width - x < DAMAGE_TILE_SIZE ? width - x : DAMAGE_TILE_SIZE;
+            size_t offset = y * stride + x * bpp;
+            if (kmsvnc->simd->cmpcpy(old + offset, new + offset, w * bpp) && !tiles[tx]) {
+                tiles[tx] = 1;
+                dirty++;
+            }
+        }
+    }
+    return dirty;
+}
+
+// copy the tiles marked dirty by the last damage_update() from src to dst
+void damage_reconcile(char *dst, const char *src, int width, int height) {
+    struct kmsvnc_damage_data *damage = kmsvnc->damage;
+    const int bpp = kmsvnc->bytes_per_pixel;
+    size_t stride = width * bpp;
+
+    for (int ty = 0; ty < damage->tiles_y; ty++) {
+        char *tiles = damage->tiles + ty * damage->tiles_x;
+        int y_end = (ty + 1) * DAMAGE_TILE_SIZE;
+        if (y_end > height) y_end = height;
+        int tx = 0;
+        while (tx < damage->tiles_x) {
+            if (!tiles[tx]) {
+                tx++;
+                continue;
+            }
+            int start = tx;
+            while (tx < damage->tiles_x && tiles[tx]) tx++;
+            int x = start * DAMAGE_TILE_SIZE;
+            int x_end = tx * DAMAGE_TILE_SIZE;
+            if (x_end > width) x_end = width;
+            for (int y = ty * DAMAGE_TILE_SIZE; y < y_end; y++) {
+                size_t offset = y * stride + x * bpp;
+                memcpy(dst + offset, src + offset, (x_end - x) * bpp);
+            }
+        }
+    }
+}
+
+// merge horizontal runs of dirty tiles, then grow runs downwards while the next
+// tile row has a run with exactly the same span
+static int damage_merge() {
+    struct kmsvnc_damage_data *damage = kmsvnc->damage;
+    int *active = damage->active;
+    int *next = damage->active + damage->tiles_x;
+    int active_count = 0;
+    int count = 0;
+
+    for (int ty = 0; ty < damage->tiles_y; ty++) {
+        char *tiles = damage->tiles + ty * damage->tiles_x;
+        int next_count = 0;
+        int ai = 0;
+        int tx = 0;
+        while (tx < damage->tiles_x) {
+            if (!tiles[tx]) {
+                tx++;
+                continue;
+            }
+            int start = tx;
+            while (tx < damage->tiles_x && tiles[tx]) tx++;
+            while (ai < active_count && damage->rects[active[ai]].x1 < start) ai++;
+            int r;
+            if (ai < active_count && damage->rects[active[ai]].x1 == start && damage->rects[active[ai]].x2 == tx) {
+                r = active[ai++];
+                damage->rects[r].y2 = ty + 1;
+            }
+            else {
+                r = count++;
+                damage->rects[r].x1 = start;
+                damage->rects[r].y1 = ty;
+                damage->rects[r].x2 = tx;
+                damage->rects[r].y2 = ty + 1;
+            }
+            next[next_count++] = r;
+        }
+        int *tmp = active;
+        active = next;
+        next = tmp;
+        active_count = next_count;
+    }
+    return count;
+}
+
+// bounding box of the dirty tiles in tile units, returns the number of dirty tiles
+int damage_bounds(struct kmsvnc_damage_rect *box) {
+    struct kmsvnc_damage_data *damage = kmsvnc->damage;
+    int count = 0;
+    box->x1 = damage->tiles_x;
+    box->y1 = damage->tiles_y;
+    box->x2 = 0;
+    box->y2 = 0;
+    for (int ty = 0; ty < damage->tiles_y; ty++) {
+        char *tiles = damage->tiles + ty * damage->tiles_x;
+        for (int tx = 0; tx < damage->tiles_x; tx++) {
+            if (!tiles[tx]) continue;
+            count++;
+            if (tx < box->x1) box->x1 = tx;
+            if (ty < box->y1) box->y1 = ty;
+            if (tx + 1 > box->x2) box->x2 = tx + 1;
+            if (ty + 1 > box->y2) box->y2 = ty + 1;
+        }
+    }
+    return count;
+}
+
+// marks x1,y1,x2,y2 minus the part covered by skip, which clients get from a CopyRect
+static void damage_mark(rfbScreenInfoPtr server, int x1, int y1, int x2, int y2, const struct kmsvnc_damage_rect *skip) {
+    if (!skip || skip->x1 >= x2 || skip->x2 <= x1 || skip->y1 >= y2 || skip->y2 <= y1) {
+        rfbMarkRectAsModified(server, x1, y1, x2, y2);
+        return;
+    }
+    if (skip->y1 > y1) rfbMarkRectAsModified(server, x1, y1, x2, skip->y1);
+    if (skip->y2 < y2) rfbMarkRectAsModified(server, x1, skip->y2, x2, y2);
+    int my1 = skip->y1 > y1 ? skip->y1 : y1;
+    int my2 = skip->y2 < y2 ? skip->y2 : y2;
+    if (skip->x1 > x1) rfbMarkRectAsModified(server, x1, my1, skip->x1, my2);
+    if (skip->x2 < x2) rfbMarkRectAsModified(server, skip->x2, my1, x2, my2);
+}
+
+void damage_report(rfbScreenInfoPtr server, int width, int height, const struct kmsvnc_damage_rect *skip) {
+    struct kmsvnc_damage_data *damage = kmsvnc->damage;
+    int count = damage_merge();
+    if (count > DAMAGE_MAX_RECTS) {
+        // too fragmented, a single bounding box is cheaper to track
+        struct kmsvnc_damage_rect box = damage->rects[0];
+        for (int i = 1; i < count; i++) {
+            struct kmsvnc_damage_rect *r = damage->rects + i;
+            if (r->x1 < box.x1) box.x1 = r->x1;
+            if (r->y1 < box.y1) box.y1 = r->y1;
+            if (r->x2 > box.x2) box.x2 = r->x2;
+            if (r->y2 > box.y2) box.y2 = r->y2;
+        }
+        damage->rects[0] = box;
+        count = 1;
+    }
+    for (int i = 0; i < count; i++) {
+        struct kmsvnc_damage_rect *r = damage->rects + i;
+        int x2 = r->x2 * DAMAGE_TILE_SIZE;
+        int y2 = r->y2 * DAMAGE_TILE_SIZE;
+        damage_mark(server, r->x1 * DAMAGE_TILE_SIZE, r->y1 * DAMAGE_TILE_SIZE, x2 > width ? width : x2, y2 > height ? height : y2, skip);
+    }
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "kmsvnc.h"
+
+void damage_cleanup();
+int damage_init(int width, int height);
+void damage_clear();
+void damage_mark_rect(int x1, int y1, int x2, int y2);
+void damage_probe_begin(char force_sweep);
+int damage_probe(const char *src, size_t src_pitch, int src_bpp, char *conv, const char *ref, int width, int height, int ty, void (*convert)(const char *, int, int, char *));
+void damage_convert(const char *src, size_t src_pitch, int src_bpp, char *dst, int width, int height, int ty, void (*convert)(const char *, int, int, char *));
+int damage_update(char *old, const char *new, int width, int height, int ty, char probing);
+void damage_reconcile(char *dst, const char *src, int width, int height);
+int damage_bounds(struct kmsvnc_damage_rect *box);
+void damage_report(rfbScreenInfoPtr server, int width, int height, const struct kmsvnc_damage_rect *skip);
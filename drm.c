@@ -5,11 +5,15 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+#include <inttypes.h>
 #include <sys/ioctl.h>
+#include <poll.h>
 #include <libdrm/drm_fourcc.h>
 
 #include "drm.h"
 #include "va.h"
+#include "damage.h"
 
 #ifndef DISABLE_KMSVNC_SCREEN_BLANK
     #include "drm_master.h"
@@ -32,135 +36,559 @@
 
 extern struct kmsvnc_data *kmsvnc;
 
+// the vnc server takes the pixel layout of the framebuffer, so capturing is a plain copy
+static void convert_copy(const char *in, int width, int height, char *buff);
+static void convert_deep(const char *in, int width, int height, char *buff);
+static void convert_pack565(const char *in, int width, int height, char *buff);
+static void convert_565(const char *in, int width, int height, char *buff);
+static void convert_1555(const char *in, int width, int height, char *buff);
+static void convert_1555_to_565(const char *in, int width, int height, char *buff);
+
 static int check_pixfmt_non_vaapi() {
+    struct kmsvnc_drm_data *drm = kmsvnc->drm;
+    uint32_t fmt = drm->mfb->pixel_format;
+    drm->deep = 0;
+    drm->server_bgrx = 0;
+    drm->src_bytes_per_pixel = BYTES_PER_PIXEL;
+    drm->rgb_shift[3] = 32;
     if (
-        kmsvnc->drm->mfb->pixel_format != KMSVNC_FOURCC_TO_INT('X', 'R', '2', '4') &&
-        kmsvnc->drm->mfb->pixel_format != KMSVNC_FOURCC_TO_INT('A', 'R', '2', '4')
+        fmt == KMSVNC_FOURCC_TO_INT('X', 'R', '2', '4') ||
+        fmt == KMSVNC_FOURCC_TO_INT('A', 'R', '2', '4')
+    )
+    {
+        drm->server_bgrx = 1;
+        drm->rgb_shift[0] = 16;
+        drm->rgb_shift[1] = 8;
+        drm->rgb_shift[2] = 0;
+    }
+    else if (
+        fmt == KMSVNC_FOURCC_TO_INT('X', 'B', '2', '4') ||
+        fmt == KMSVNC_FOURCC_TO_INT('A', 'B', '2', '4')
+    )
+    {
+        drm->rgb_shift[0] = 0;
+        drm->rgb_shift[1] = 8;
+        drm->rgb_shift[2] = 16;
+    }
+    else if (
+        fmt == KMSVNC_FOURCC_TO_INT('X', 'R', '3', '0') ||
+        fmt == KMSVNC_FOURCC_TO_INT('A', 'R', '3', '0') ||
+        fmt == KMSVNC_FOURCC_TO_INT('X', 'B', '3', '0') ||
+        fmt == KMSVNC_FOURCC_TO_INT('A', 'B', '3', '0')
     )
     {
-        KMSVNC_FATAL("Unsupported pixfmt %s, please create an issue with your pixfmt.\n", kmsvnc->drm->pixfmt_name);
+        // red is in the top channel of XR30, the bottom one of XB30
+        char bgr = fmt == KMSVNC_FOURCC_TO_INT('X', 'R', '3', '0') || fmt == KMSVNC_FOURCC_TO_INT('A', 'R', '3', '0');
+        drm->deep = 1;
+        drm->rgb_shift[0] = bgr ? 22 : 2;
+        drm->rgb_shift[1] = 12;
+        drm->rgb_shift[2] = bgr ? 2 : 22;
+        drm->funcs->convert = convert_deep;
+    }
+    else if (fmt == KMSVNC_FOURCC_TO_INT('R', 'G', '1', '6'))
+    {
+        drm->src_bytes_per_pixel = 2;
+        drm->funcs->convert = kmsvnc->bytes_per_pixel == 2 ? convert_copy : convert_565;
+    }
+    else if (
+        fmt == KMSVNC_FOURCC_TO_INT('X', 'R', '1', '5') ||
+        fmt == KMSVNC_FOURCC_TO_INT('A', 'R', '1', '5')
+    )
+    {
+        drm->src_bytes_per_pixel = 2;
+        drm->funcs->convert = kmsvnc->bytes_per_pixel == 2 ? convert_1555_to_565 : convert_1555;
+    }
+    else
+    {
+        KMSVNC_FATAL("Unsupported pixfmt %s, please create an issue with your pixfmt.\n", drm->pixfmt_name);
+    }
+    if (kmsvnc->bytes_per_pixel == 2 && drm->src_bytes_per_pixel == BYTES_PER_PIXEL) {
+        drm->funcs->convert = convert_pack565;
     }
     return 0;
 }
 
-static void convert_copy(const char *in, int width, int height, char *buff)
+// linear sources may pad their rows to pitches[0], calls spanning several rows are split up then
+static int convert_padded(const char *in, int width, int height, char *buff, void (*convert)(const char *, int, int, char *))
 {
-    if (likely(in != buff)) {
-        memcpy(buff, in, width * height * BYTES_PER_PIXEL);
+    size_t pitch = kmsvnc->drm->mfb->pitches[0];
+    if (height < 2 || pitch == (size_t)width * kmsvnc->drm->src_bytes_per_pixel) return 0;
+    for (int y = 0; y < height; y++) {
+        convert(in + y * pitch, width, 1, buff + (size_t)y * width * kmsvnc->bytes_per_pixel);
     }
+    return 1;
 }
 
-static void convert_bgra_to_rgba(const char *in, int width, int height, char *buff)
+static void convert_copy(const char *in, int width, int height, char *buff)
 {
+    if (convert_padded(in, width, height, buff, convert_copy)) return;
     if (likely(in != buff)) {
-        memcpy(buff, in, width * height * BYTES_PER_PIXEL);
-    }
-    for (int i = 0; i < width * height * BYTES_PER_PIXEL; i += BYTES_PER_PIXEL) {
-        uint32_t pixdata = htonl(*((uint32_t*)(buff + i)));
-        buff[i+0] = (pixdata & 0x0000ff00) >> 8;
-        buff[i+2] = (pixdata & 0xff000000) >> 24;
+        if (kmsvnc->drm->read) {
+            kmsvnc->drm->read(buff, in, (size_t)width * height * kmsvnc->drm->src_bytes_per_pixel);
+        }
+        else {
+            memcpy(buff, in, (size_t)width * height * kmsvnc->drm->src_bytes_per_pixel);
+        }
     }
 }
 
-static inline char convert_buf_allocate(size_t len) {
-    if (kmsvnc->drm->kms_convert_buf_len < len)
-    {
-        if (kmsvnc->drm->kms_convert_buf)
-            free(kmsvnc->drm->kms_convert_buf);
-        kmsvnc->drm->kms_convert_buf = malloc(len);
-        if (!kmsvnc->drm->kms_convert_buf) return 1;
-        kmsvnc->drm->kms_convert_buf_len = len;
-    }
-    return 0;
+static void copy_row(char *dst, const char *src, size_t len)
+{
+    memcpy(dst, src, len);
 }
-static inline void convert_x_tiled(const int tilex, const int tiley, const char *in, int width, int height, char *buff)
+
+static void deep_row(char *dst, const char *src, size_t len)
 {
-    if (width % tilex)
-    {
-        return;
+    kmsvnc->simd->unpack(dst, src, len, kmsvnc->drm->rgb_shift);
+}
+
+// tiles of tilex by tiley pixels are stored one after another, a row of tiles spans the pitch
+// the source is read one whole tile at a time and every tile row is copied (or swizzled by row) in one go,
+// tilex and tiley are constants in the callers so the index math folds into shifts
+static inline __attribute__((always_inline)) void detile_x_tile(const int tilex, void (*row)(char *, const char *, size_t), const char *src, char *dst, size_t stride, size_t len, int rows)
+{
+    for (int r = 0; r < rows; r++) {
+        row(dst + r * stride, src + r * tilex * BYTES_PER_PIXEL, len);
     }
-    if (height % tiley)
-    {
-        int sno = (width / tilex) + (height / tiley) * (width / tilex);
-        int ord = (width % tilex) + (height % tiley) * tilex;
-        int max_offset = sno * tilex * tiley + ord;
-        if (kmsvnc->drm->kms_cpy_tmp_buf_len < max_offset * 4 + 4)
-        {
-            if (kmsvnc->drm->kms_cpy_tmp_buf)
-                free(kmsvnc->drm->kms_convert_buf);
-            kmsvnc->drm->kms_cpy_tmp_buf = malloc(max_offset * 4 + 4);
-            if (!kmsvnc->drm->kms_cpy_tmp_buf) return;
-            kmsvnc->drm->kms_cpy_tmp_buf_len = max_offset * 4 + 4;
+}
+
+static inline __attribute__((always_inline)) int detile_x_tiles_per_row(const int tilex, int width, int pitch)
+{
+    int tiles_x = (width + tilex - 1) / tilex;
+    int tiles_per_row = pitch / (tilex * BYTES_PER_PIXEL);
+    return tiles_per_row < tiles_x ? tiles_x : tiles_per_row;
+}
+
+// whole tiles are pulled out of the mapping here first when it is read with streaming loads
+static __thread char detile_bounce[DRM_TILE_MAX_SIZE] __attribute__((aligned(64)));
+
+static inline __attribute__((always_inline)) void detile_x(const int tilex, const int tiley, void (*row)(char *, const char *, size_t), void (*read)(char *, const char *, size_t), const char *in, int width, int height, int pitch, char *buff)
+{
+    const size_t tile_row = tilex * BYTES_PER_PIXEL;
+    const size_t tile_size = tile_row * tiley;
+    const size_t stride = width * BYTES_PER_PIXEL;
+    int tiles_x = (width + tilex - 1) / tilex;
+    int tiles_per_row = detile_x_tiles_per_row(tilex, width, pitch);
+
+    for (int ty = 0; ty * tiley < height; ty++) {
+        int rows = height - ty * tiley < tiley ? height - ty * tiley : tiley;
+        for (int tx = 0; tx < tiles_x; tx++) {
+            const char *src = in + ((size_t)ty * tiles_per_row + tx) * tile_size;
+            if (read) {
+                read(detile_bounce, src, rows * tile_row);
+                src = detile_bounce;
+            }
+            char *dst = buff + (size_t)ty * tiley * stride + tx * tile_row;
+            size_t len = width - tx * tilex < tilex ? (width - tx * tilex) * BYTES_PER_PIXEL : tile_row;
+            detile_x_tile(tilex, row, src, dst, stride, len, rows);
         }
-        memcpy(kmsvnc->drm->kms_cpy_tmp_buf, in, max_offset * 4 + 4);
-        in = (const char *)kmsvnc->drm->kms_cpy_tmp_buf;
     }
-    if (convert_buf_allocate(width * height * 4)) return;
-    for (int y = 0; y < height; y++)
-    {
-        for (int x = 0; x < width; x++)
-        {
-            int sno = (x / tilex) + (y / tiley) * (width / tilex);
-            int ord = (x % tilex) + (y % tiley) * tilex;
-            int offset = sno * tilex * tiley + ord;
-            memcpy(kmsvnc->drm->kms_convert_buf + (x + y * width) * 4, in + offset * 4, 4);
+}
+
+// every tile is one contiguous block, compare it against the shadow of the last frame before detiling
+// changed tiles are detiled from the shadow into buff and marked as damaged
+// returns the number of changed tiles in tile row ty
+static inline __attribute__((always_inline)) int detile_x_diff(const int tilex, const int tiley, void (*row)(char *, const char *, size_t), const char *in, char *shadow, int width, int height, int pitch, int ty, char *buff)
+{
+    const size_t tile_row = tilex * BYTES_PER_PIXEL;
+    const size_t tile_size = tile_row * tiley;
+    const size_t stride = width * BYTES_PER_PIXEL;
+    int tiles_x = (width + tilex - 1) / tilex;
+    int tiles_per_row = detile_x_tiles_per_row(tilex, width, pitch);
+    int y = ty * tiley;
+    int rows = height - y < tiley ? height - y : tiley;
+    int changed = 0;
+
+    for (int tx = 0; tx < tiles_x; tx++) {
+        size_t offset = ((size_t)ty * tiles_per_row + tx) * tile_size;
+        const char *src = in + offset;
+        // rows past the bottom of the screen may not be mapped
+        if (kmsvnc->drm->read) {
+            kmsvnc->drm->read(detile_bounce, src, rows * tile_row);
+            src = detile_bounce;
         }
+        if (!kmsvnc->simd->cmpcpy(shadow + offset, src, rows * tile_row)) continue;
+        int x = tx * tilex;
+        int w = width - x < tilex ? width - x : tilex;
+        detile_x_tile(tilex, row, shadow + offset, buff + (size_t)y * stride + x * BYTES_PER_PIXEL, stride, w * BYTES_PER_PIXEL, rows);
+        damage_mark_rect(x, y, x + w, y + rows);
+        changed++;
     }
-    convert_bgra_to_rgba(kmsvnc->drm->kms_convert_buf, width, height, buff);
+    return changed;
 }
 
+void detile_nvidia_x(const char *in, int width, int height, int pitch, char *buff, void (*row)(char *, const char *, size_t))
+{
+    detile_x(16, 128, row, NULL, in, width, height, pitch, buff);
+}
+void detile_intel_x(const char *in, int width, int height, int pitch, char *buff, void (*row)(char *, const char *, size_t))
+{
+    detile_x(128, 8, row, NULL, in, width, height, pitch, buff);
+}
+
+// deep sources are converted a tile row at a time while detiling, the shadow keeps the raw pixels
 void convert_nvidia_x_tiled_kmsbuf(const char *in, int width, int height, char *buff)
 {
-    convert_x_tiled(16, 128, in, width, height, buff);
+    if (kmsvnc->drm->deep) {
+        detile_x(16, 128, deep_row, kmsvnc->drm->read, in, width, height, kmsvnc->drm->mfb->pitches[0], buff);
+    }
+    else {
+        detile_x(16, 128, copy_row, kmsvnc->drm->read, in, width, height, kmsvnc->drm->mfb->pitches[0], buff);
+    }
 }
 void convert_intel_x_tiled_kmsbuf(const char *in, int width, int height, char *buff)
 {
-    convert_x_tiled(128, 8, in, width, height, buff);
+    if (kmsvnc->drm->deep) {
+        detile_x(128, 8, deep_row, kmsvnc->drm->read, in, width, height, kmsvnc->drm->mfb->pitches[0], buff);
+    }
+    else {
+        detile_x(128, 8, copy_row, kmsvnc->drm->read, in, width, height, kmsvnc->drm->mfb->pitches[0], buff);
+    }
 }
 
-static void convert_vaapi(const char *in, int width, int height, char *buff) {
-    va_hwframe_to_vaapi(buff);
-    if (
-        (KMSVNC_FOURCC_TO_INT('R','G','B',0) & kmsvnc->va->selected_fmt->fourcc) == KMSVNC_FOURCC_TO_INT('R','G','B',0)
-    ) {}
+static int diff_nvidia_x_tiled_kmsbuf(const char *in, int width, int height, int band, char *buff)
+{
+    if (kmsvnc->drm->deep) {
+        return detile_x_diff(16, 128, deep_row, in, kmsvnc->drm->shadow, width, height, kmsvnc->drm->mfb->pitches[0], band, buff);
+    }
+    return detile_x_diff(16, 128, copy_row, in, kmsvnc->drm->shadow, width, height, kmsvnc->drm->mfb->pitches[0], band, buff);
+}
+static int diff_intel_x_tiled_kmsbuf(const char *in, int width, int height, int band, char *buff)
+{
+    if (kmsvnc->drm->deep) {
+        return detile_x_diff(128, 8, deep_row, in, kmsvnc->drm->shadow, width, height, kmsvnc->drm->mfb->pitches[0], band, buff);
+    }
+    return detile_x_diff(128, 8, copy_row, in, kmsvnc->drm->shadow, width, height, kmsvnc->drm->mfb->pitches[0], band, buff);
+}
+
+// byte offsets of byte x of row y inside one tile, x counts bytes
+
+// 16 byte wide columns of 32 rows each
+static size_t swizzle_intel_y(int x, int y)
+{
+    return (x >> 4) * 16 * 32 + y * 16 + (x & 15);
+}
+
+// 64 byte blocks of 4 rows of 16 bytes, arranged in 2 by 2 and then 2 by 4 groups
+static size_t swizzle_intel_4(int x, int y)
+{
+    return (x & 15) | (y & 3) << 4 | (x >> 4 & 3) << 6 | (y >> 2 & 1) << 8 | (x >> 6 & 1) << 9 | (y >> 3 & 3) << 10;
+}
+
+// gfx9 64KiB standard swizzle of 32 bit pixels, the pixel bits are x0 x1 y0 y1 x2 y2 ... x6 y6
+static size_t swizzle_amd_64k_s(int x, int y)
+{
+    size_t offset = (x & 15) | (y & 3) << 4;
+    int px = x / BYTES_PER_PIXEL;
+    for (int i = 2; i < 7; i++) {
+        offset |= (size_t)(px >> i & 1) << (2 * i + 2);
+        offset |= (size_t)(y >> i & 1) << (2 * i + 3);
+    }
+    return offset;
+}
+
+// builds the span table for modifier, returns non-zero if it has no cpu detiler
+int drm_swizzle_setup(uint64_t modifier, struct kmsvnc_drm_swizzle *swizzle)
+{
+    size_t (*offset)(int, int);
+    memset(swizzle, 0, sizeof(*swizzle));
+    if (modifier == I915_FORMAT_MOD_Y_TILED) {
+        swizzle->name = "intel y-tiled";
+        swizzle->tile_w = 32;
+        swizzle->tile_h = 32;
+        offset = swizzle_intel_y;
+    }
+    else if (modifier == I915_FORMAT_MOD_4_TILED) {
+        swizzle->name = "intel tile4";
+        swizzle->tile_w = 32;
+        swizzle->tile_h = 32;
+        offset = swizzle_intel_4;
+    }
+    else if (IS_AMD_FMT_MOD(modifier) && AMD_FMT_MOD_GET(TILE, modifier) == AMD_FMT_MOD_TILE_GFX9_64K_S && !AMD_FMT_MOD_GET(DCC, modifier)) {
+        // the _X variants xor in pipe and bank bits, those are left to vaapi
+        swizzle->name = "amd 64k_s";
+        swizzle->tile_w = 128;
+        swizzle->tile_h = 128;
+        offset = swizzle_amd_64k_s;
+    }
     else {
-        // is 30 depth?
-        if (kmsvnc->va->selected_fmt->depth == 30) {
-            for (int i = 0; i < width * height * BYTES_PER_PIXEL; i += BYTES_PER_PIXEL) {
-                // ensure little endianess
-                uint32_t pixdata = __builtin_bswap32(htonl(*((uint32_t*)(buff + i))));
-                buff[i] = (pixdata & 0x3ff00000) >> 20 >> 2;
-                buff[i+1] = (pixdata & 0xffc00) >> 10 >> 2;
-                buff[i+2] = (pixdata & 0x3ff) >> 2;
-            }
+        return 1;
+    }
+    int cols = swizzle->tile_w * BYTES_PER_PIXEL / 16;
+    swizzle->spans = malloc(sizeof(uint16_t) * cols * swizzle->tile_h);
+    if (!swizzle->spans) KMSVNC_FATAL("memory allocation error at %s:%d\n", __FILE__, __LINE__);
+    for (int y = 0; y < swizzle->tile_h; y++) {
+        for (int c = 0; c < cols; c++) {
+            swizzle->spans[y * cols + c] = offset(c * 16, y) / 16;
         }
-        else {
-            // actually, does anyone use this?
-            if (!kmsvnc->va->selected_fmt->byte_order) {
-                for (int i = 0; i < width * height * BYTES_PER_PIXEL; i += BYTES_PER_PIXEL) {
-                    uint32_t *pixdata = (uint32_t*)(buff + i);
-                    *pixdata = __builtin_bswap32(*pixdata);
-                }
-            }
+    }
+    return 0;
+}
+
+void drm_swizzle_cleanup(struct kmsvnc_drm_swizzle *swizzle)
+{
+    if (swizzle->spans) {
+        free(swizzle->spans);
+    }
+    memset(swizzle, 0, sizeof(*swizzle));
+}
+
+// copies the visible w by rows pixels of one tile, 16 bytes at a time, post converts the rows in place
+static void detile_swizzled_tile(const struct kmsvnc_drm_swizzle *swizzle, void (*post)(char *, const char *, size_t), const char *src, char *dst, size_t stride, int w, int rows)
+{
+    int cols = swizzle->tile_w * BYTES_PER_PIXEL / 16;
+    int full = w * BYTES_PER_PIXEL / 16;
+    int rest = w * BYTES_PER_PIXEL % 16;
+    for (int y = 0; y < rows; y++) {
+        const uint16_t *spans = swizzle->spans + y * cols;
+        char *d = dst + y * stride;
+        for (int c = 0; c < full; c++) {
+            memcpy(d + c * 16, src + spans[c] * 16, 16);
+        }
+        if (rest) {
+            memcpy(d + full * 16, src + spans[full] * 16, rest);
+        }
+        if (post) {
+            post(d, d, w * BYTES_PER_PIXEL);
         }
-        // is xrgb?
-        if ((kmsvnc->va->selected_fmt->blue_mask | kmsvnc->va->selected_fmt->red_mask) < 0x1000000) {
-            for (int i = 0; i < width * height * BYTES_PER_PIXEL; i += BYTES_PER_PIXEL) {
-                uint32_t *pixdata = (uint32_t*)(buff + i);
-                *pixdata = ntohl(htonl(*pixdata) << 8);
+    }
+}
+
+// the rows of a swizzled tile are interleaved, so tiles are always read whole
+static void detile_swizzle(const struct kmsvnc_drm_swizzle *swizzle, void (*read)(char *, const char *, size_t), void (*post)(char *, const char *, size_t), const char *in, int width, int height, int pitch, char *buff)
+{
+    const size_t tile_size = (size_t)swizzle->tile_w * swizzle->tile_h * BYTES_PER_PIXEL;
+    const size_t stride = width * BYTES_PER_PIXEL;
+    int tiles_x = (width + swizzle->tile_w - 1) / swizzle->tile_w;
+    int tiles_per_row = detile_x_tiles_per_row(swizzle->tile_w, width, pitch);
+
+    for (int ty = 0; ty * swizzle->tile_h < height; ty++) {
+        int y = ty * swizzle->tile_h;
+        int rows = height - y < swizzle->tile_h ? height - y : swizzle->tile_h;
+        for (int tx = 0; tx < tiles_x; tx++) {
+            const char *src = in + ((size_t)ty * tiles_per_row + tx) * tile_size;
+            if (read) {
+                read(detile_bounce, src, tile_size);
+                src = detile_bounce;
             }
+            int x = tx * swizzle->tile_w;
+            int w = width - x < swizzle->tile_w ? width - x : swizzle->tile_w;
+            detile_swizzled_tile(swizzle, post, src, buff + (size_t)y * stride + x * BYTES_PER_PIXEL, stride, w, rows);
+        }
+    }
+}
+
+void detile_swizzled(const struct kmsvnc_drm_swizzle *swizzle, const char *in, int width, int height, int pitch, char *buff)
+{
+    detile_swizzle(swizzle, NULL, NULL, in, width, height, pitch, buff);
+}
+
+static void convert_swizzled_kmsbuf(const char *in, int width, int height, char *buff)
+{
+    struct kmsvnc_drm_data *drm = kmsvnc->drm;
+    detile_swizzle(&drm->swizzle, drm->read, drm->deep ? deep_row : NULL, in, width, height, drm->mfb->pitches[0], buff);
+}
+
+// same as detile_x_diff() with whole swizzled tiles
+static int diff_swizzled_kmsbuf(const char *in, int width, int height, int band, char *buff)
+{
+    struct kmsvnc_drm_data *drm = kmsvnc->drm;
+    const struct kmsvnc_drm_swizzle *swizzle = &drm->swizzle;
+    const size_t tile_size = (size_t)swizzle->tile_w * swizzle->tile_h * BYTES_PER_PIXEL;
+    const size_t stride = width * BYTES_PER_PIXEL;
+    int tiles_x = (width + swizzle->tile_w - 1) / swizzle->tile_w;
+    int tiles_per_row = detile_x_tiles_per_row(swizzle->tile_w, width, drm->mfb->pitches[0]);
+    int y = band * swizzle->tile_h;
+    int rows = height - y < swizzle->tile_h ? height - y : swizzle->tile_h;
+    int changed = 0;
+
+    for (int tx = 0; tx < tiles_x; tx++) {
+        size_t offset = ((size_t)band * tiles_per_row + tx) * tile_size;
+        const char *src = in + offset;
+        if (drm->read) {
+            drm->read(detile_bounce, src, tile_size);
+            src = detile_bounce;
         }
-        // is bgrx?
-        if (kmsvnc->va->selected_fmt->blue_mask > kmsvnc->va->selected_fmt->red_mask) {
-            for (int i = 0; i < width * height * BYTES_PER_PIXEL; i += BYTES_PER_PIXEL) {
-                uint32_t pixdata = htonl(*((uint32_t*)(buff + i)));
-                buff[i+0] = (pixdata & 0x0000ff00) >> 8;
-                buff[i+2] = (pixdata & 0xff000000) >> 24;
+        if (!kmsvnc->simd->cmpcpy(drm->shadow + offset, src, tile_size)) continue;
+        int x = tx * swizzle->tile_w;
+        int w = width - x < swizzle->tile_w ? width - x : swizzle->tile_w;
+        detile_swizzled_tile(swizzle, drm->deep ? deep_row : NULL, drm->shadow + offset, buff + (size_t)y * stride + x * BYTES_PER_PIXEL, stride, w, rows);
+        damage_mark_rect(x, y, x + w, y + rows);
+        changed++;
+    }
+    return changed;
+}
+
+// 2x2 ordered dither, in units of the two bits dropped from each 10 bit channel
+static const uint8_t deep_bayer[2][2] = {{0, 2}, {3, 1}};
+
+// linear 2:10:10:10 sources, callers pass whole rows or a span of one row of the mapping,
+// so where the pixels sit on screen follows from their offset into it
+static void convert_deep(const char *in, int width, int height, char *buff)
+{
+    struct kmsvnc_drm_data *drm = kmsvnc->drm;
+    size_t pitch = drm->mfb->pitches[0];
+    size_t pos = in - drm->mapped;
+    int x = pos % pitch / BYTES_PER_PIXEL;
+    int y = pos / pitch;
+    size_t len = (size_t)width * BYTES_PER_PIXEL;
+    if (!kmsvnc->dither && pitch == len) {
+        len *= height;
+        height = 1;
+    }
+    for (int r = 0; r < height; r++) {
+        const char *src = in + r * pitch;
+        char *dst = buff + r * len;
+        for (size_t done = 0; done < len; done += DRM_TILE_MAX_SIZE) {
+            size_t n = len - done < DRM_TILE_MAX_SIZE ? len - done : DRM_TILE_MAX_SIZE;
+            const char *chunk = src + done;
+            if (drm->read) {
+                drm->read(detile_bounce, chunk, n);
+                chunk = detile_bounce;
+            }
+            if (kmsvnc->dither) {
+                int px = x + done / BYTES_PER_PIXEL;
+                const uint8_t *pattern = deep_bayer[(y + r) & 1];
+                uint8_t bias[2] = {pattern[px & 1], pattern[(px + 1) & 1]};
+                kmsvnc->simd->dither(dst + done, chunk, n, drm->rgb_shift, bias);
+            }
+            else {
+                kmsvnc->simd->unpack(dst + done, chunk, n, drm->rgb_shift);
             }
         }
     }
 }
 
+// runs row over the mapping, through the bounce buffer when it has to be read with streaming loads
+static void convert_mapped(const char *in, int width, int height, char *buff, void (*row)(char *, const char *, size_t))
+{
+    struct kmsvnc_drm_data *drm = kmsvnc->drm;
+    if (drm->mfb->pitches[0] != (size_t)width * drm->src_bytes_per_pixel && height > 1) {
+        for (int y = 0; y < height; y++) {
+            convert_mapped(in + (size_t)y * drm->mfb->pitches[0], width, 1, buff + (size_t)y * width * kmsvnc->bytes_per_pixel, row);
+        }
+        return;
+    }
+    size_t len = (size_t)width * height * drm->src_bytes_per_pixel;
+    if (!drm->read) {
+        row(buff, in, len);
+        return;
+    }
+    for (size_t done = 0; done < len; done += DRM_TILE_MAX_SIZE) {
+        size_t n = len - done < DRM_TILE_MAX_SIZE ? len - done : DRM_TILE_MAX_SIZE;
+        drm->read(detile_bounce, in + done, n);
+        row(buff + done / drm->src_bytes_per_pixel * kmsvnc->bytes_per_pixel, detile_bounce, n);
+    }
+}
+
+static void pack565_row(char *dst, const char *src, size_t len)
+{
+    kmsvnc->simd->pack565(dst, src, len, kmsvnc->drm->rgb_shift);
+}
+
+// 16 bit sources, channels are widened by repeating their top bits
+static void expand565_row(char *dst, const char *src, size_t len)
+{
+    const uint16_t *in = (const uint16_t*)src;
+    uint32_t *out = (uint32_t*)dst;
+    for (size_t i = 0; i < len / 2; i++) {
+        uint32_t p = in[i];
+        uint32_t r = p >> 11 & 0x1f, g = p >> 5 & 0x3f, b = p & 0x1f;
+        out[i] = (r << 3 | r >> 2) | (g << 2 | g >> 4) << 8 | (b << 3 | b >> 2) << 16;
+    }
+}
+
+static void expand1555_row(char *dst, const char *src, size_t len)
+{
+    const uint16_t *in = (const uint16_t*)src;
+    uint32_t *out = (uint32_t*)dst;
+    for (size_t i = 0; i < len / 2; i++) {
+        uint32_t p = in[i];
+        uint32_t r = p >> 10 & 0x1f, g = p >> 5 & 0x1f, b = p & 0x1f;
+        out[i] = (r << 3 | r >> 2) | (g << 3 | g >> 2) << 8 | (b << 3 | b >> 2) << 16;
+    }
+}
+
+static void x1555_to_565_row(char *dst, const char *src, size_t len)
+{
+    const uint16_t *in = (const uint16_t*)src;
+    uint16_t *out = (uint16_t*)dst;
+    for (size_t i = 0; i < len / 2; i++) {
+        uint16_t p = in[i];
+        out[i] = (p & 0x7fe0) << 1 | (p & 0x200) >> 4 | (p & 0x1f);
+    }
+}
+
+static void convert_pack565(const char *in, int width, int height, char *buff)
+{
+    convert_mapped(in, width, height, buff, pack565_row);
+}
+
+static void convert_565(const char *in, int width, int height, char *buff)
+{
+    convert_mapped(in, width, height, buff, expand565_row);
+}
+
+static void convert_1555(const char *in, int width, int height, char *buff)
+{
+    convert_mapped(in, width, height, buff, expand1555_row);
+}
+
+static void convert_1555_to_565(const char *in, int width, int height, char *buff)
+{
+    convert_mapped(in, width, height, buff, x1555_to_565_row);
+}
+
+static double drm_time_read(void (*read)(char *, const char *, size_t), char *dst, size_t len) {
+    double best = 0;
+    for (int i = 0; i < DRM_READ_PROBE_ROUNDS; i++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        read(dst, kmsvnc->drm->mapped, len);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double t = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        if (!i || t < best) best = t;
+    }
+    return best;
+}
+
+// write-combined and uncached mappings are much faster to read with streaming loads,
+// cached ones are not, so time both on the mapping actually in use
+static void drm_probe_read() {
+    struct kmsvnc_drm_data *drm = kmsvnc->drm;
+    drm->read = NULL;
+    if (!drm->mapped || !kmsvnc->simd->stream) return;
+
+    size_t len = drm->mmap_size < DRM_READ_PROBE_SIZE ? drm->mmap_size : DRM_READ_PROBE_SIZE;
+    char *tmp = malloc(len);
+    if (!tmp) return;
+    drm->funcs->sync_start(drm->prime_fd);
+    double plain = drm_time_read(copy_row, tmp, len);
+    double stream = drm_time_read(kmsvnc->simd->stream, tmp, len);
+    drm->funcs->sync_end(drm->prime_fd);
+    free(tmp);
+
+    printf("reading the framebuffer with %s loads (plain %.2f GB/s, streaming %.2f GB/s)\n",
+        stream < plain ? "streaming" : "plain", len / plain / 1e9, len / stream / 1e9);
+    if (stream < plain) drm->read = kmsvnc->simd->stream;
+}
+
+// the shadow mirrors the tiled source of the frame in the back buffer
+static int drm_shadow_allocate(int tilex, int tiley) {
+    struct kmsvnc_drm_data *drm = kmsvnc->drm;
+    int tiles_per_row = detile_x_tiles_per_row(tilex, drm->mfb->width, drm->mfb->pitches[0]);
+    drm->funcs->diff_rows = tiley;
+    drm->shadow_len = (size_t)tiles_per_row * tilex * tiley * BYTES_PER_PIXEL * ((drm->mfb->height + tiley - 1) / tiley);
+    drm->shadow = malloc(drm->shadow_len);
+    if (!drm->shadow) KMSVNC_FATAL("memory allocation error at %s:%d\n", __FILE__, __LINE__);
+    memset(drm->shadow, 0, drm->shadow_len);
+    return 0;
+}
+
+static void convert_vaapi(const char *in, int width, int height, char *buff) {
+    va_convert(buff);
+}
+
 static inline void drm_sync(int drmfd, uint64_t flags)
 {
     struct dma_buf_sync sync = {
@@ -169,8 +597,27 @@ static inline void drm_sync(int drmfd, uint64_t flags)
     DRM_R_IOCTL_MAY(drmfd, DMA_BUF_IOCTL_SYNC, &sync);
 }
 
+// a dma-buf polls readable once its implicit write fences have signalled, so a frame
+// still being rendered is not read half done. bounded, a busy gpu must not stall capture
+static void drm_wait_fence(int fd)
+{
+    if (!kmsvnc->vnc_opt->fence_timeout_ms) return;
+    struct pollfd pfd = {
+        .fd = fd,
+        .events = POLLIN,
+    };
+    int ret;
+    do {
+        ret = poll(&pfd, 1, kmsvnc->vnc_opt->fence_timeout_ms);
+    } while (ret < 0 && errno == EINTR);
+    if (ret == 0) {
+        KMSVNC_DEBUG("framebuffer still busy after %d ms, reading it anyway\n", kmsvnc->vnc_opt->fence_timeout_ms);
+    }
+}
+
 void drm_sync_start(int drmfd)
 {
+    drm_wait_fence(drmfd);
     drm_sync(drmfd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
 }
 void drm_sync_end(int drmfd)
@@ -181,6 +628,132 @@ void drm_sync_noop(int drmfd)
 {
 }
 
+static void drm_close_handle(uint32_t handle) {
+    struct drm_gem_close close_arg;
+    memset(&close_arg, 0, sizeof(close_arg));
+    close_arg.handle = handle;
+    DRM_IOCTL_MAY(kmsvnc->drm->drm_fd, DRM_IOCTL_GEM_CLOSE, &close_arg);
+}
+
+// drmModeGetFB2 opens new gem handles every time it is called
+static void drm_free_fb2(drmModeFB2 *mfb) {
+    for (int i = 0; i < 4; i++) {
+        if (!mfb->handles[i]) continue;
+        char seen = 0;
+        for (int j = 0; j < i; j++) {
+            if (mfb->handles[j] == mfb->handles[i]) seen = 1;
+        }
+        if (!seen) drm_close_handle(mfb->handles[i]);
+    }
+    drmModeFreeFB2(mfb);
+}
+
+// the current framebuffer lives in drm->mfb, drm->prime_fd, drm->mapped, va->surface_id ...
+static void drm_fb_save(struct kmsvnc_drm_fb *fb) {
+    struct kmsvnc_drm_data *drm = kmsvnc->drm;
+    memset(fb, 0, sizeof(struct kmsvnc_drm_fb));
+    fb->fb_id = drm->mfb ? drm->mfb->fb_id : 0;
+    fb->mfb = drm->mfb;
+    fb->prime_fd = drm->prime_fd;
+    fb->gem_handle = drm->gem_handle;
+    fb->mapped = drm->mapped;
+    fb->mmap_size = drm->mmap_size;
+    if (kmsvnc->va) {
+        fb->va_surface_id = kmsvnc->va->surface_id;
+        if (kmsvnc->va->derive_enabled) {
+            fb->va_image = kmsvnc->va->image;
+            fb->va_imgbuf = kmsvnc->va->imgbuf;
+        }
+    }
+}
+
+static void drm_fb_activate(struct kmsvnc_drm_fb *fb) {
+    struct kmsvnc_drm_data *drm = kmsvnc->drm;
+    drm->mfb = fb->mfb;
+    drm->prime_fd = fb->prime_fd;
+    drm->gem_handle = fb->gem_handle;
+    drm->mapped = fb->mapped;
+    drm->mmap_size = fb->mmap_size;
+    if (kmsvnc->va) {
+        kmsvnc->va->surface_id = fb->va_surface_id;
+        if (kmsvnc->va->derive_enabled) {
+            kmsvnc->va->image = fb->va_image;
+            kmsvnc->va->imgbuf = fb->va_imgbuf;
+        }
+    }
+    drm->current_fb = fb;
+}
+
+static void drm_fb_release(struct kmsvnc_drm_fb *fb) {
+    if (fb->mapped && fb->mapped != MAP_FAILED) {
+        munmap(fb->mapped, fb->mmap_size);
+    }
+    if (kmsvnc->va && (fb->va_surface_id || fb->va_image)) {
+        va_release_surface(fb->va_surface_id, fb->va_image, fb->va_imgbuf);
+    }
+    if (fb->prime_fd > 0) {
+        close(fb->prime_fd);
+    }
+    if (fb->gem_handle) {
+        drm_close_handle(fb->gem_handle);
+    }
+    if (fb->mfb) {
+        drm_free_fb2(fb->mfb);
+    }
+    memset(fb, 0, sizeof(struct kmsvnc_drm_fb));
+}
+
+// move the current framebuffer into the cache, evicting the least recently used one if full
+static void drm_fb_store() {
+    struct kmsvnc_drm_data *drm = kmsvnc->drm;
+    struct kmsvnc_drm_fb *fb;
+    if (drm->fb_cache_count < DRM_FB_CACHE_SIZE) {
+        fb = drm->fb_cache + drm->fb_cache_count++;
+    }
+    else {
+        fb = drm->fb_cache;
+        for (int i = 1; i < DRM_FB_CACHE_SIZE; i++) {
+            if (drm->fb_cache[i].last_used < fb->last_used) fb = drm->fb_cache + i;
+        }
+        KMSVNC_DEBUG("evicting framebuffer %u\n", fb->fb_id);
+        drm_fb_release(fb);
+    }
+    drm_fb_save(fb);
+    fb->last_used = drm->fb_cache_clock;
+    drm->current_fb = fb;
+}
+
+static struct kmsvnc_drm_failed_fb *drm_failed_fb_find(uint32_t fb_id) {
+    struct kmsvnc_drm_data *drm = kmsvnc->drm;
+    for (int i = 0; i < drm->failed_fb_count; i++) {
+        if (drm->failed_fbs[i].fb_id == fb_id) return drm->failed_fbs + i;
+    }
+    return NULL;
+}
+
+// remembers a framebuffer that could not be captured, evicting the least recently seen one if full
+// returns 1 if it was not known yet
+static int drm_failed_fb_store(uint32_t fb_id) {
+    struct kmsvnc_drm_data *drm = kmsvnc->drm;
+    struct kmsvnc_drm_failed_fb *failed = drm_failed_fb_find(fb_id);
+    int fresh = !failed;
+    if (!failed) {
+        if (drm->failed_fb_count < DRM_FB_CACHE_SIZE) {
+            failed = drm->failed_fbs + drm->failed_fb_count++;
+        }
+        else {
+            failed = drm->failed_fbs;
+            for (int i = 1; i < DRM_FB_CACHE_SIZE; i++) {
+                if (drm->failed_fbs[i].last_used < failed->last_used) failed = drm->failed_fbs + i;
+            }
+        }
+        failed->fb_id = fb_id;
+    }
+    failed->last_used = drm->fb_cache_clock;
+    failed->checked = drm->fb_cache_clock;
+    return fresh;
+}
+
 void drm_cleanup() {
     if (kmsvnc->drm) {
 #ifndef DISABLE_KMSVNC_SCREEN_BLANK
@@ -196,6 +769,20 @@ void drm_cleanup() {
             kmsvnc->drm->gamma = NULL;
         }
 #endif
+        if (!kmsvnc->drm->current_fb) {
+            // failed before the first framebuffer made it into the cache
+            struct kmsvnc_drm_fb fb;
+            drm_fb_save(&fb);
+            drm_fb_release(&fb);
+        }
+        for (int i = 0; i < kmsvnc->drm->fb_cache_count; i++) {
+            drm_fb_release(kmsvnc->drm->fb_cache + i);
+        }
+        kmsvnc->drm->fb_cache_count = 0;
+        kmsvnc->drm->current_fb = NULL;
+        kmsvnc->drm->mfb = NULL;
+        kmsvnc->drm->mapped = NULL;
+        kmsvnc->drm->prime_fd = 0;
         if (kmsvnc->drm->drm_ver) {
             drmFreeVersion(kmsvnc->drm->drm_ver);
             kmsvnc->drm->drm_ver = NULL;
@@ -220,26 +807,20 @@ void drm_cleanup() {
             drmModeFreePlane(kmsvnc->drm->cursor_plane);
             kmsvnc->drm->cursor_plane = NULL;
         }
-        if (kmsvnc->drm->mfb) {
-            drmModeFreeFB2(kmsvnc->drm->mfb);
-            kmsvnc->drm->mfb = NULL;
-        }
-        if (kmsvnc->drm->cursor_mfb) {
-            drmModeFreeFB2(kmsvnc->drm->cursor_mfb);
-            kmsvnc->drm->cursor_mfb = NULL;
-        }
-        if (kmsvnc->drm->mapped && kmsvnc->drm->mapped != MAP_FAILED) {
-            munmap(kmsvnc->drm->mapped, kmsvnc->drm->mmap_size);
-            kmsvnc->drm->mapped = NULL;
+        for (int i = 0; i < kmsvnc->drm->cursor_cache_count; i++) {
+            drm_fb_release(kmsvnc->drm->cursor_cache + i);
         }
-        if (kmsvnc->drm->cursor_mapped && kmsvnc->drm->cursor_mapped != MAP_FAILED) {
-            munmap(kmsvnc->drm->cursor_mapped, kmsvnc->drm->cursor_mmap_size);
-            kmsvnc->drm->cursor_mapped = NULL;
+        kmsvnc->drm->cursor_cache_count = 0;
+        kmsvnc->drm->cursor_fb = NULL;
+        if (kmsvnc->drm->cursor_prop_ids) {
+            free(kmsvnc->drm->cursor_prop_ids);
+            kmsvnc->drm->cursor_prop_ids = NULL;
         }
-        if (kmsvnc->drm->prime_fd > 0) {
-            close(kmsvnc->drm->prime_fd);
-            kmsvnc->drm->prime_fd = 0;
+        if (kmsvnc->drm->cursor_prop_values) {
+            free(kmsvnc->drm->cursor_prop_values);
+            kmsvnc->drm->cursor_prop_values = NULL;
         }
+        kmsvnc->drm->cursor_props_count = 0;
         if (kmsvnc->drm->drm_fd > 0) {
             close(kmsvnc->drm->drm_fd);
             kmsvnc->drm->drm_fd = 0;
@@ -252,16 +833,12 @@ void drm_cleanup() {
             drmModeFreePlaneResources(kmsvnc->drm->plane_res);
             kmsvnc->drm->plane_res = NULL;
         }
-        if (kmsvnc->drm->kms_convert_buf) {
-            free(kmsvnc->drm->kms_convert_buf);
-            kmsvnc->drm->kms_convert_buf = NULL;
+        if (kmsvnc->drm->shadow) {
+            free(kmsvnc->drm->shadow);
+            kmsvnc->drm->shadow = NULL;
         }
-        kmsvnc->drm->kms_convert_buf_len = 0;
-        if (kmsvnc->drm->kms_cpy_tmp_buf) {
-            free(kmsvnc->drm->kms_cpy_tmp_buf);
-            kmsvnc->drm->kms_cpy_tmp_buf = NULL;
-        }
-        kmsvnc->drm->kms_cpy_tmp_buf_len = 0;
+        drm_swizzle_cleanup(&kmsvnc->drm->swizzle);
+        kmsvnc->drm->shadow_len = 0;
         if (kmsvnc->drm->kms_cursor_buf) {
             free(kmsvnc->drm->kms_cursor_buf);
             kmsvnc->drm->kms_cursor_buf = NULL;
@@ -383,113 +960,277 @@ static int drm_refresh_planes(char first_time) {
     return 0;
 }
 
-int drm_dump_cursor_plane(char **data, int *width, int *height) {
+// maps a cursor framebuffer on first sight, evicting the least recently used mapping if full
+static int drm_cursor_fb_import(uint32_t fb_id, struct kmsvnc_drm_fb **out) {
     struct kmsvnc_drm_data *drm = kmsvnc->drm;
 
-    if (!drm->cursor_plane) {
-        drm_refresh_planes(0); // ignore error
-        if (drm->cursor_plane) {
-            printf("Using cursor plane %u\n", drm->cursor_plane->plane_id);
+    for (int i = 0; i < drm->cursor_cache_count; i++) {
+        if (drm->cursor_cache[i].fb_id == fb_id) {
+            *out = drm->cursor_cache + i;
+            return 0;
         }
     }
-    else {
-        uint32_t plane_id = drm->cursor_plane->plane_id;
-        drmModeFreePlane(drm->cursor_plane);
-        drm->cursor_plane = NULL;
-        drm->cursor_plane = drmModeGetPlane(drm->drm_fd, plane_id);
-    }
-    if (!drm->cursor_plane) {
-        data = NULL;
-        return 1;
-    }
-    if (drm->cursor_mfb) drmModeFreeFB2(drm->cursor_mfb);
-    drm->cursor_mfb = drmModeGetFB2(drm->drm_fd, drm->cursor_plane->fb_id);
-    if (!drm->cursor_mfb) {
+
+    struct kmsvnc_drm_fb fb;
+    memset(&fb, 0, sizeof(fb));
+    fb.fb_id = fb_id;
+    fb.mfb = drmModeGetFB2(drm->drm_fd, fb_id);
+    if (!fb.mfb) {
         KMSVNC_DEBUG("Cursor framebuffer missing\n");
         return 1;
     }
 
-    if (drm->cursor_mfb->modifier != DRM_FORMAT_MOD_NONE && drm->cursor_mfb->modifier != DRM_FORMAT_MOD_LINEAR) {
-        //kmsvnc->capture_cursor = 0;
-        KMSVNC_DEBUG("Cursor plane modifier is not linear: %lu\n", drm->cursor_mfb->modifier);
-        return 1;
+    if (fb.mfb->modifier != DRM_FORMAT_MOD_NONE && fb.mfb->modifier != DRM_FORMAT_MOD_LINEAR) {
+        KMSVNC_DEBUG("Cursor plane modifier is not linear: %lu\n", fb.mfb->modifier);
+        goto fail;
     }
 
     if (
-        drm->cursor_mfb->pixel_format != KMSVNC_FOURCC_TO_INT('A', 'R', '2', '4') &&
-        drm->cursor_mfb->pixel_format != KMSVNC_FOURCC_TO_INT('A', 'R', '3', '0')
+        fb.mfb->pixel_format != KMSVNC_FOURCC_TO_INT('A', 'R', '2', '4') &&
+        fb.mfb->pixel_format != KMSVNC_FOURCC_TO_INT('A', 'R', '3', '0')
     )
     {
-        //kmsvnc->capture_cursor = 0;
-        char *fmtname = drmGetFormatName(drm->cursor_mfb->pixel_format);
-        KMSVNC_DEBUG("Cursor plane pixel format unsupported (%u, %s)\n", drm->cursor_mfb->pixel_format, fmtname);
+        char *fmtname = drmGetFormatName(fb.mfb->pixel_format);
+        KMSVNC_DEBUG("Cursor plane pixel format unsupported (%u, %s)\n", fb.mfb->pixel_format, fmtname);
         free(fmtname);
-        return 1;
+        goto fail;
     }
 
     struct drm_gem_flink flink;
-    flink.handle = drm->cursor_mfb->handles[0];
-    DRM_IOCTL_MUST(drm->drm_fd, DRM_IOCTL_GEM_FLINK, &flink);
+    flink.handle = fb.mfb->handles[0];
+    if (drmIoctl(drm->drm_fd, DRM_IOCTL_GEM_FLINK, &flink)) goto fail_ioctl;
 
     struct drm_gem_open open_arg;
     open_arg.name = flink.name;
-    DRM_IOCTL_MUST(drm->drm_fd, DRM_IOCTL_GEM_OPEN, &open_arg);
+    if (drmIoctl(drm->drm_fd, DRM_IOCTL_GEM_OPEN, &open_arg)) goto fail_ioctl;
+    fb.gem_handle = open_arg.handle;
 
     struct drm_mode_map_dumb mreq;
     memset(&mreq, 0, sizeof(mreq));
     mreq.handle = open_arg.handle;
-    DRM_IOCTL_MUST(drm->drm_fd, DRM_IOCTL_MODE_MAP_DUMB, &mreq);
+    if (drmIoctl(drm->drm_fd, DRM_IOCTL_MODE_MAP_DUMB, &mreq)) goto fail_ioctl;
 
-    size_t mmap_size = open_arg.size;
-    if (mmap_size != drm->cursor_mfb->width * drm->cursor_mfb->height * BYTES_PER_PIXEL) {
-        KMSVNC_DEBUG("Cursor plane mmap_size != calculated size (%ld, %d)\n", mmap_size, drm->cursor_mfb->width * drm->cursor_mfb->height * BYTES_PER_PIXEL);
-        return 1;
+    fb.mmap_size = open_arg.size;
+    if (fb.mmap_size != fb.mfb->width * fb.mfb->height * BYTES_PER_PIXEL) {
+        KMSVNC_DEBUG("Cursor plane mmap_size != calculated size (%ld, %d)\n", fb.mmap_size, fb.mfb->width * fb.mfb->height * BYTES_PER_PIXEL);
+        goto fail;
     }
 
-    off_t mmap_offset = mreq.offset;
-    if (drm->cursor_mapped && drm->cursor_mapped != MAP_FAILED) munmap(drm->cursor_mapped, drm->cursor_mmap_size);
-    drm->cursor_mapped = mmap(NULL, mmap_size, PROT_READ, MAP_SHARED, drm->drm_fd, mmap_offset);
-    if (drm->cursor_mapped == MAP_FAILED)
+    fb.mapped = mmap(NULL, fb.mmap_size, PROT_READ, MAP_SHARED, drm->drm_fd, mreq.offset);
+    if (fb.mapped == MAP_FAILED)
     {
+        fb.mapped = NULL;
         KMSVNC_DEBUG("Failed to mmap cursor: %s\n", strerror(errno));
+        goto fail;
+    }
+
+    struct kmsvnc_drm_fb *slot;
+    if (drm->cursor_cache_count < DRM_FB_CACHE_SIZE) {
+        slot = drm->cursor_cache + drm->cursor_cache_count++;
+    }
+    else {
+        slot = drm->cursor_cache;
+        for (int i = 1; i < DRM_FB_CACHE_SIZE; i++) {
+            if (drm->cursor_cache[i].last_used < slot->last_used) slot = drm->cursor_cache + i;
+        }
+        if (slot == drm->cursor_fb) drm->cursor_fb = NULL;
+        drm_fb_release(slot);
+    }
+    *slot = fb;
+    *out = slot;
+    return 0;
+
+fail_ioctl:
+    KMSVNC_DEBUG("Failed to map cursor framebuffer %u: %s\n", fb_id, strerror(errno));
+fail:
+    // not retried until the cursor plane shows another framebuffer
+    drm->cursor_failed_fb_id = fb_id;
+    drm_fb_release(&fb);
+    return 1;
+}
+
+// rich cursors are sent in the server pixel layout
+static void drm_cursor_convert(struct kmsvnc_drm_fb *fb) {
+    struct kmsvnc_drm_data *drm = kmsvnc->drm;
+    memcpy(drm->kms_cursor_buf, fb->mapped, fb->mmap_size);
+    int red = drm->server_bgrx ? 2 : 0;
+    if (fb->mfb->pixel_format == KMSVNC_FOURCC_TO_INT('X', 'R', '3', '0') ||
+        fb->mfb->pixel_format == KMSVNC_FOURCC_TO_INT('A', 'R', '3', '0'))
+    {
+        for (int i = 0; i < fb->mfb->width * fb->mfb->height * BYTES_PER_PIXEL; i += BYTES_PER_PIXEL) {
+            uint32_t pixdata = __builtin_bswap32(htonl(*((uint32_t*)(drm->kms_cursor_buf + i))));
+            drm->kms_cursor_buf[i + red] = (pixdata & 0x3ff00000) >> 20 >> 2;
+            drm->kms_cursor_buf[i+1] = (pixdata & 0xffc00) >> 10 >> 2;
+            drm->kms_cursor_buf[i + 2 - red] = (pixdata & 0x3ff) >> 2;
+            drm->kms_cursor_buf[i+3] = (pixdata & 0xc0000000) >> 30 << 6;
+        }
+    }
+    if (!drm->server_bgrx && (fb->mfb->pixel_format == KMSVNC_FOURCC_TO_INT('X', 'R', '2', '4') ||
+        fb->mfb->pixel_format == KMSVNC_FOURCC_TO_INT('A', 'R', '2', '4')))
+    {
+        // bgra to rgba
+        for (int i = 0; i < fb->mfb->width * fb->mfb->height * BYTES_PER_PIXEL; i += BYTES_PER_PIXEL) {
+            uint32_t pixdata = htonl(*((uint32_t*)(drm->kms_cursor_buf + i)));
+            drm->kms_cursor_buf[i+0] = (pixdata & 0x0000ff00) >> 8;
+            drm->kms_cursor_buf[i+2] = (pixdata & 0xff000000) >> 24;
+        }
+    }
+}
+
+// sets *data only when the cursor plane shows another framebuffer than last time, or with reread
+// set, which catches cursors drawn into the framebuffer already on the plane
+int drm_dump_cursor_plane(char **data, int *width, int *height, char reread) {
+    struct kmsvnc_drm_data *drm = kmsvnc->drm;
+
+    if (!drm->cursor_plane) {
+        drm_refresh_planes(0); // ignore error
+        if (drm->cursor_plane) {
+            printf("Using cursor plane %u\n", drm->cursor_plane->plane_id);
+        }
+    }
+    if (!drm->cursor_plane) {
         return 1;
     }
-    else
+
+    // drmModeGetPlane would do a second ioctl for the format list
+    struct drm_mode_get_plane get_plane;
+    memset(&get_plane, 0, sizeof(get_plane));
+    get_plane.plane_id = drm->cursor_plane->plane_id;
+    if (drmIoctl(drm->drm_fd, DRM_IOCTL_MODE_GETPLANE, &get_plane)) return 1;
+    if (!get_plane.fb_id || get_plane.fb_id == drm->cursor_failed_fb_id) return 1;
+    // the id may be reused by a new cursor fb later
+    drm->cursor_failed_fb_id = 0;
+
+    drm->cursor_cache_clock++;
+    if (drm->cursor_fb && drm->cursor_fb->fb_id == get_plane.fb_id) {
+        drm->cursor_fb->last_used = drm->cursor_cache_clock;
+        if (!reread) return 0;
+    }
+
+    struct kmsvnc_drm_fb *fb;
+    if (drm_cursor_fb_import(get_plane.fb_id, &fb)) return 1;
+    fb->last_used = drm->cursor_cache_clock;
+
+    if (drm->kms_cursor_buf_len < fb->mmap_size)
     {
-        if (kmsvnc->drm->kms_cursor_buf_len < mmap_size)
-        {
-            if (kmsvnc->drm->kms_cursor_buf)
-                free(kmsvnc->drm->kms_cursor_buf);
-            kmsvnc->drm->kms_cursor_buf = malloc(mmap_size);
-            if (!kmsvnc->drm->kms_cursor_buf) return 1;
-            kmsvnc->drm->kms_cursor_buf_len = mmap_size;
-        }
-        memcpy(drm->kms_cursor_buf, drm->cursor_mapped, mmap_size);
-        if (drm->cursor_mfb->pixel_format == KMSVNC_FOURCC_TO_INT('X', 'R', '3', '0') ||
-            drm->cursor_mfb->pixel_format == KMSVNC_FOURCC_TO_INT('A', 'R', '3', '0'))
-        {
-            for (int i = 0; i < drm->cursor_mfb->width * drm->cursor_mfb->height * BYTES_PER_PIXEL; i += BYTES_PER_PIXEL) {
-                uint32_t pixdata = __builtin_bswap32(htonl(*((uint32_t*)(kmsvnc->drm->kms_cursor_buf + i))));
-                kmsvnc->drm->kms_cursor_buf[i] = (pixdata & 0x3ff00000) >> 20 >> 2;
-                kmsvnc->drm->kms_cursor_buf[i+1] = (pixdata & 0xffc00) >> 10 >> 2;
-                kmsvnc->drm->kms_cursor_buf[i+2] = (pixdata & 0x3ff) >> 2;
-                kmsvnc->drm->kms_cursor_buf[i+3] = (pixdata & 0xc0000000) >> 30 << 6;
-            }
+        if (drm->kms_cursor_buf)
+            free(drm->kms_cursor_buf);
+        drm->kms_cursor_buf = malloc(fb->mmap_size);
+        if (!drm->kms_cursor_buf) {
+            drm->kms_cursor_buf_len = 0;
+            return 1;
         }
-        if (drm->cursor_mfb->pixel_format == KMSVNC_FOURCC_TO_INT('X', 'R', '2', '4') || 
-            drm->cursor_mfb->pixel_format == KMSVNC_FOURCC_TO_INT('A', 'R', '2', '4'))
-        {
-            // bgra to rgba
-            for (int i = 0; i < drm->cursor_mfb->width * drm->cursor_mfb->height * BYTES_PER_PIXEL; i += BYTES_PER_PIXEL) {
-                uint32_t pixdata = htonl(*((uint32_t*)(kmsvnc->drm->kms_cursor_buf + i)));
-                kmsvnc->drm->kms_cursor_buf[i+0] = (pixdata & 0x0000ff00) >> 8;
-                kmsvnc->drm->kms_cursor_buf[i+2] = (pixdata & 0xff000000) >> 24;
-            }
+        drm->kms_cursor_buf_len = fb->mmap_size;
+    }
+    drm_cursor_convert(fb);
+    drm->cursor_fb = fb;
+    *width = fb->mfb->width;
+    *height = fb->mfb->height;
+    *data = drm->kms_cursor_buf;
+    return 0;
+}
+
+// looks up CRTC_X and CRTC_Y by name once, later reads only fetch the values
+static int drm_cursor_props_setup() {
+    struct kmsvnc_drm_data *drm = kmsvnc->drm;
+    drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(drm->drm_fd, drm->cursor_plane->plane_id, DRM_MODE_OBJECT_PLANE);
+    if (!props) return 1;
+    drm->cursor_prop_x = drm->cursor_prop_y = -1;
+    for (int i = 0; i < props->count_props; i++) {
+        drmModePropertyPtr prop = drmModeGetProperty(drm->drm_fd, props->props[i]);
+        if (!prop) continue;
+        if (strcmp(prop->name, "CRTC_X") == 0) {
+            drm->cursor_prop_x = i;
+            drm->cursor_prop_x_id = prop->prop_id;
         }
-        *width = drm->cursor_mfb->width;
-        *height = drm->cursor_mfb->height;
-        *data = drm->kms_cursor_buf;
+        else if (strcmp(prop->name, "CRTC_Y") == 0) {
+            drm->cursor_prop_y = i;
+            drm->cursor_prop_y_id = prop->prop_id;
+        }
+        drmModeFreeProperty(prop);
+    }
+    uint32_t count = props->count_props;
+    drmModeFreeObjectProperties(props);
+    if (drm->cursor_prop_x < 0 || drm->cursor_prop_y < 0) {
+        KMSVNC_DEBUG("Cursor plane has no CRTC_X/CRTC_Y properties\n");
+        return 1;
+    }
+    if (drm->cursor_props_count < count) {
+        uint32_t *ids = realloc(drm->cursor_prop_ids, sizeof(uint32_t) * count);
+        if (!ids) return 1;
+        drm->cursor_prop_ids = ids;
+        uint64_t *values = realloc(drm->cursor_prop_values, sizeof(uint64_t) * count);
+        if (!values) return 1;
+        drm->cursor_prop_values = values;
     }
+    drm->cursor_props_count = count;
+    return 0;
+}
+
+// where the top left corner of the cursor plane is on the crtc, one ioctl per call
+int drm_cursor_position(int *x, int *y) {
+    struct kmsvnc_drm_data *drm = kmsvnc->drm;
+    if (!drm->cursor_plane) return 1;
+    if (!drm->cursor_props_count && drm_cursor_props_setup()) return 1;
+
+    struct drm_mode_obj_get_properties get_props;
+    memset(&get_props, 0, sizeof(get_props));
+    get_props.props_ptr = (uint64_t)(uintptr_t)drm->cursor_prop_ids;
+    get_props.prop_values_ptr = (uint64_t)(uintptr_t)drm->cursor_prop_values;
+    get_props.count_props = drm->cursor_props_count;
+    get_props.obj_id = drm->cursor_plane->plane_id;
+    get_props.obj_type = DRM_MODE_OBJECT_PLANE;
+    if (drmIoctl(drm->drm_fd, DRM_IOCTL_MODE_OBJ_GETPROPERTIES, &get_props)) return 1;
+    if (drm->cursor_prop_ids[drm->cursor_prop_x] != drm->cursor_prop_x_id ||
+        drm->cursor_prop_ids[drm->cursor_prop_y] != drm->cursor_prop_y_id)
+    {
+        // the property list changed under us, look them up again next time
+        drm->cursor_props_count = 0;
+        return 1;
+    }
+    // both are signed, the cursor can hang off the top and left edges
+    *x = (int)(int64_t)drm->cursor_prop_values[drm->cursor_prop_x];
+    *y = (int)(int64_t)drm->cursor_prop_values[drm->cursor_prop_y];
+    return 0;
+}
+
+static void drm_find_crtc_index() {
+    struct kmsvnc_drm_data *drm = kmsvnc->drm;
+    drm->crtc_index = -1;
+    drmModeRes *res = drmModeGetResources(drm->drm_fd);
+    if (!res) {
+        fprintf(stderr, "Failed to get mode resources: %s\n", strerror(errno));
+        return;
+    }
+    for (int i = 0; i < res->count_crtcs; i++) {
+        if (res->crtcs[i] == drm->plane->crtc_id) {
+            drm->crtc_index = i;
+            break;
+        }
+    }
+    drmModeFreeResources(res);
+}
+
+// wait until count vblanks after the last one we waited for, or the next one if that is already gone
+int drm_wait_vblank(unsigned int count) {
+    struct kmsvnc_drm_data *drm = kmsvnc->drm;
+    if (drm->crtc_index < 0) return 1;
+
+    drmVBlank vbl;
+    memset(&vbl, 0, sizeof(vbl));
+    vbl.request.type = DRM_VBLANK_ABSOLUTE | DRM_VBLANK_NEXTONMISS;
+    if (drm->crtc_index == 1) {
+        vbl.request.type |= DRM_VBLANK_SECONDARY;
+    }
+    else if (drm->crtc_index > 1) {
+        vbl.request.type |= (drm->crtc_index << DRM_VBLANK_HIGH_CRTC_SHIFT) & DRM_VBLANK_HIGH_CRTC_MASK;
+    }
+    vbl.request.sequence = drm->vblank_seq + count;
+    if (drmWaitVBlank(drm->drm_fd, &vbl)) {
+        // crtc is off or the driver has no vblank interrupt
+        return 1;
+    }
+    drm->vblank_seq = vbl.reply.sequence;
     return 0;
 }
 
@@ -527,6 +1268,7 @@ int drm_open() {
     }
 
     if (drm_refresh_planes(1)) return 1;
+    drm_find_crtc_index();
 
 #ifndef DISABLE_KMSVNC_SCREEN_BLANK
     if (kmsvnc->screen_blank) {
@@ -609,10 +1351,12 @@ int drm_open() {
     }
 
     drm->mmap_fd = drm->drm_fd;
+    drm->src_bytes_per_pixel = BYTES_PER_PIXEL;
     drm->mmap_size = drm->mfb->width * drm->mfb->height * BYTES_PER_PIXEL;
     drm->funcs = malloc(sizeof(struct kmsvnc_drm_funcs));
     if (!drm->funcs) KMSVNC_FATAL("memory allocation error at %s:%d\n", __FILE__, __LINE__);
-    drm->funcs->convert = convert_bgra_to_rgba;
+    drm->funcs->convert = convert_copy;
+    drm->funcs->convert_linear = 1;
     drm->funcs->sync_start = drm_sync_noop;
     drm->funcs->sync_end = drm_sync_noop;
 
@@ -645,7 +1389,12 @@ static int drm_kmsbuf_prime_vaapi() {
         KMSVNC_FATAL("Failed to get PRIME fd from framebuffer handle\n");
     }
 
-    if (va_init()) return 1;
+    if (!kmsvnc->va) {
+        if (va_init()) return 1;
+    }
+    else {
+        if (va_import_surface()) return 1;
+    }
 
     drm->mmap_fd = drm->prime_fd;
     drm->skip_map = 1;
@@ -662,6 +1411,7 @@ static int drm_kmsbuf_dumb() {
     struct drm_gem_open open_arg;
     open_arg.name = flink.name;
     DRM_IOCTL_MUST(drm->drm_fd, DRM_IOCTL_GEM_OPEN, &open_arg);
+    drm->gem_handle = open_arg.handle;
 
     struct drm_mode_map_dumb mreq;
     memset(&mreq, 0, sizeof(mreq));
@@ -673,27 +1423,176 @@ static int drm_kmsbuf_dumb() {
     return 0;
 }
 
-int drm_vendors() {
+static int drm_kmsbuf_i915_gem() {
     struct kmsvnc_drm_data *drm = kmsvnc->drm;
 
-    char *driver_name;
-    if (kmsvnc->force_driver) {
-        printf("using %s instead of %s\n", kmsvnc->force_driver, drm->drm_ver->name);
-        driver_name = kmsvnc->force_driver;
+    struct drm_gem_flink flink;
+    flink.handle = drm->mfb->handles[0];
+    DRM_IOCTL_MUST(drm->drm_fd, DRM_IOCTL_GEM_FLINK, &flink);
+
+    struct drm_gem_open open_arg;
+    open_arg.name = flink.name;
+    DRM_IOCTL_MUST(drm->drm_fd, DRM_IOCTL_GEM_OPEN, &open_arg);
+    drm->gem_handle = open_arg.handle;
+
+    struct drm_i915_gem_mmap_gtt mmap_arg;
+    mmap_arg.handle = open_arg.handle;
+    DRM_IOCTL_MUST(drm->drm_fd, DRM_IOCTL_I915_GEM_MMAP_GTT, &mmap_arg);
+    drm->mmap_size = open_arg.size;
+    drm->mmap_offset = mmap_arg.offset;
+    return 0;
+}
+
+static int drm_import() {
+    struct kmsvnc_drm_data *drm = kmsvnc->drm;
+
+    drm->prime_fd = 0;
+    drm->gem_handle = 0;
+    drm->mapped = NULL;
+    drm->mmap_fd = drm->drm_fd;
+    drm->mmap_size = (size_t)drm->mfb->pitches[0] * drm->mfb->height;
+    drm->mmap_offset = 0;
+
+    if (drm->funcs->import()) return 1;
+    if (drm->swizzle.spans) {
+        // swizzled tiles are read whole, including rows below the screen
+        int tile_h = drm->swizzle.tile_h;
+        drm->mmap_size = (size_t)drm->mfb->pitches[0] * ((drm->mfb->height + tile_h - 1) / tile_h * tile_h);
     }
-    else {
-        driver_name = drm->drm_ver->name;
+
+    if (!drm->skip_map)
+    {
+        if (!drm->current_fb) printf("mapping with size = %lu, offset = %ld, fd = %d\n", drm->mmap_size, drm->mmap_offset, drm->mmap_fd);
+        drm->mapped = mmap(NULL, drm->mmap_size, PROT_READ, MAP_SHARED, drm->mmap_fd, drm->mmap_offset);
+        if (drm->mapped == MAP_FAILED)
+        {
+            drm->mapped = NULL;
+            KMSVNC_FATAL("Failed to mmap: %s\n", strerror(errno));
+        }
+    }
+    return 0;
+}
+
+static char drm_is_vaapi_driver(const char *driver_name) {
+    return strcmp(driver_name, "i915") == 0 || strcmp(driver_name, "amdgpu") == 0;
+}
+
+static char drm_is_linear() {
+    return kmsvnc->drm->mfb->modifier == DRM_FORMAT_MOD_NONE || kmsvnc->drm->mfb->modifier == DRM_FORMAT_MOD_LINEAR;
+}
+
+// returns 1 without a message when the modifier can not be detiled on the cpu
+static int drm_method_cpu() {
+    struct kmsvnc_drm_data *drm = kmsvnc->drm;
+    if (!drm_is_linear() && !drm->swizzle.spans && drm_swizzle_setup(drm->mfb->modifier, &drm->swizzle)) return 1;
+    if (check_pixfmt_non_vaapi()) return 1;
+    if (drm->swizzle.spans) {
+        printf("detiling %s framebuffers on the cpu\n", drm->swizzle.name);
+        drm->funcs->convert = &convert_swizzled_kmsbuf;
+        drm->funcs->convert_linear = 0;
+        drm->funcs->diff = &diff_swizzled_kmsbuf;
+        if (drm_shadow_allocate(drm->swizzle.tile_w, drm->swizzle.tile_h)) return 1;
     }
+    drm->funcs->import = &drm_kmsbuf_prime;
+    return 0;
+}
+
+static int drm_method_vaapi() {
+    struct kmsvnc_drm_data *drm = kmsvnc->drm;
+    if (fourcc_mod_is_vendor(drm->mfb->modifier, INTEL)) {
+        if (strstr(drm->mod_name, "CCS")) {
+            printf("warn: intel with CCS modifier detected, please set INTEL_DEBUG=noccs\n");
+        }
+    };
+    drm->funcs->convert = &convert_vaapi;
+    drm->funcs->convert_linear = 0;
+    drm->funcs->import = &drm_kmsbuf_prime_vaapi;
+    return 0;
+}
+
+static int drm_method_vaapi_getimage() {
+    kmsvnc->va_derive_enabled = 0;
+    return drm_method_vaapi();
+}
+
+static int drm_method_vaapi_derive() {
+    kmsvnc->va_derive_enabled = 1;
+    return drm_method_vaapi();
+}
 
-    if (strcmp(driver_name, "i915") == 0 || strcmp(driver_name, "amdgpu") == 0)
+static int drm_method_prime() {
+    if (check_pixfmt_non_vaapi()) return 1;
+    kmsvnc->drm->funcs->import = &drm_kmsbuf_prime;
+    return 0;
+}
+
+static int drm_method_dumb() {
+    if (check_pixfmt_non_vaapi()) return 1;
+    kmsvnc->drm->funcs->import = &drm_kmsbuf_dumb;
+    return 0;
+}
+
+struct drm_capture_method {
+    const char *name;
+    // i915 and amdgpu get vaapi and cpu detiling, other drivers prime and dumb maps of linear framebuffers
+    char vaapi_driver;
+    int (*setup)();
+};
+
+static const struct drm_capture_method drm_capture_methods[] = {
+    {"cpu", 1, drm_method_cpu},
+    {"vaapi-getimage", 1, drm_method_vaapi_getimage},
+    {"vaapi-derive", 1, drm_method_vaapi_derive},
+    {"prime", 0, drm_method_prime},
+    {"dumb", 0, drm_method_dumb},
+};
+
+static char drm_method_applies(const struct drm_capture_method *method, const char *driver_name) {
+    if (method->vaapi_driver != drm_is_vaapi_driver(driver_name)) return 0;
+    if (!method->vaapi_driver && !drm_is_linear()) return 0;
+    // an explicit --va-derive only leaves its own vaapi method
+    if (method->setup == drm_method_vaapi_getimage && kmsvnc->va_derive_enabled > 0) return 0;
+    if (method->setup == drm_method_vaapi_derive && kmsvnc->va_derive_enabled == 0) return 0;
+    return 1;
+}
+
+// drop everything a method set up, keeping drm->mfb for the next one
+static void drm_method_reset() {
+    struct kmsvnc_drm_data *drm = kmsvnc->drm;
+    struct kmsvnc_drm_fb fb;
+    drm_fb_save(&fb);
+    fb.mfb = NULL;
+    drm_fb_release(&fb);
+    va_cleanup();
+    drm->prime_fd = 0;
+    drm->gem_handle = 0;
+    drm->mapped = NULL;
+    drm->skip_map = 0;
+    drm->read = NULL;
+    drm->server_bgrx = 0;
+    if (drm->shadow) {
+        free(drm->shadow);
+        drm->shadow = NULL;
+        drm->shadow_len = 0;
+    }
+    drm_swizzle_cleanup(&drm->swizzle);
+    drm->funcs->convert = convert_copy;
+    drm->funcs->convert_linear = 1;
+    drm->funcs->diff = NULL;
+    drm->funcs->diff_rows = 0;
+    drm->funcs->sync_start = drm_sync_noop;
+    drm->funcs->sync_end = drm_sync_noop;
+}
+
+static int drm_vendor_setup(const char *driver_name) {
+    struct kmsvnc_drm_data *drm = kmsvnc->drm;
+
+    if (drm_is_vaapi_driver(driver_name))
     {
-        if (fourcc_mod_is_vendor(drm->mfb->modifier, INTEL)) {
-            if (strstr(drm->mod_name, "CCS")) {
-                printf("warn: intel with CCS modifier detected, please set INTEL_DEBUG=noccs\n");
-            }
-        };
-        drm->funcs->convert = &convert_vaapi;
-        if (drm_kmsbuf_prime_vaapi()) return 1;
+        if (kmsvnc->cpu_detile && (drm_is_linear() || !drm_swizzle_setup(drm->mfb->modifier, &drm->swizzle))) {
+            if (drm_method_cpu()) return 1;
+        }
+        else if (drm_method_vaapi()) return 1;
     }
     else if (strcmp(driver_name, "nvidia-drm") == 0)
     {
@@ -701,8 +1600,11 @@ int drm_vendors() {
         printf("warn: nvidia card detected. Currently only x-tiled framebuffer is supported. Performance may suffer.\n");
         if (drm->mfb->modifier != DRM_FORMAT_MOD_NONE && drm->mfb->modifier != DRM_FORMAT_MOD_LINEAR) {
             drm->funcs->convert = &convert_nvidia_x_tiled_kmsbuf;
+            drm->funcs->convert_linear = 0;
+            drm->funcs->diff = &diff_nvidia_x_tiled_kmsbuf;
+            if (drm_shadow_allocate(16, 128)) return 1;
         }
-        if (drm_kmsbuf_dumb()) return 1;
+        drm->funcs->import = &drm_kmsbuf_dumb;
     }
     else if (strcmp(driver_name, "vmwgfx") == 0 ||
              strcmp(driver_name, "vboxvideo") == 0 ||
@@ -714,40 +1616,31 @@ int drm_vendors() {
             printf("warn: modifier is not LINEAR, please create an issue with your modifier.\n");
         }
         // virgl does not work
-        if (drm_kmsbuf_dumb()) return 1;
+        drm->funcs->import = &drm_kmsbuf_dumb;
     }
     else if (strcmp(driver_name, "test-prime") == 0)
     {
         if (check_pixfmt_non_vaapi()) return 1;
-        if (drm_kmsbuf_prime()) return 1;
+        drm->funcs->import = &drm_kmsbuf_prime;
     }
     else if (strcmp(driver_name, "test-map-dumb") == 0)
     {
         if (check_pixfmt_non_vaapi()) return 1;
-        if (drm_kmsbuf_dumb()) return 1;
+        drm->funcs->import = &drm_kmsbuf_dumb;
     }
     else if (strcmp(driver_name, "test-i915-gem") == 0)
     {
         if (check_pixfmt_non_vaapi()) return 1;
-        struct drm_gem_flink flink;
-        flink.handle = drm->mfb->handles[0];
-        DRM_IOCTL_MUST(drm->drm_fd, DRM_IOCTL_GEM_FLINK, &flink);
-
-        struct drm_gem_open open_arg;
-        open_arg.name = flink.name;
-        DRM_IOCTL_MUST(drm->drm_fd, DRM_IOCTL_GEM_OPEN, &open_arg);
-
-        struct drm_i915_gem_mmap_gtt mmap_arg;
-        mmap_arg.handle = open_arg.handle;
-        DRM_IOCTL_MUST(drm->drm_fd, DRM_IOCTL_I915_GEM_MMAP_GTT, &mmap_arg);
-        drm->mmap_size = open_arg.size;
-        drm->mmap_offset = mmap_arg.offset;
+        drm->funcs->import = &drm_kmsbuf_i915_gem;
     }
     else if (strcmp(driver_name, "test-i915-prime-xtiled") == 0)
     {
         if (check_pixfmt_non_vaapi()) return 1;
         drm->funcs->convert = &convert_intel_x_tiled_kmsbuf;
-        if (drm_kmsbuf_prime()) return 1;
+        drm->funcs->convert_linear = 0;
+        drm->funcs->diff = &diff_intel_x_tiled_kmsbuf;
+        if (drm_shadow_allocate(128, 8)) return 1;
+        drm->funcs->import = &drm_kmsbuf_prime;
     }
     else
     {
@@ -756,18 +1649,285 @@ int drm_vendors() {
         if (drm->mfb->modifier != DRM_FORMAT_MOD_NONE && drm->mfb->modifier != DRM_FORMAT_MOD_LINEAR) {
             printf("warn: modifier is not LINEAR, please create an issue with your driver and modifier.\n");
         }
-        if (drm_kmsbuf_dumb()) return 1;
+        drm->funcs->import = &drm_kmsbuf_dumb;
+    }
+    return 0;
+}
+
+// captures one frame with the method that is set up, returns 1 if it cannot
+static int drm_method_frame(char *buff) {
+    struct kmsvnc_drm_data *drm = kmsvnc->drm;
+    // the tiled and vaapi paths only deal in 32 bit pixels
+    if (!drm->funcs->convert_linear && (drm->src_bytes_per_pixel != BYTES_PER_PIXEL || kmsvnc->bytes_per_pixel != BYTES_PER_PIXEL)) return 1;
+    if (drm_import()) return 1;
+    drm->funcs->sync_start(drm->prime_fd);
+    drm->funcs->convert(drm->mapped, drm->mfb->width, drm->mfb->height, buff);
+    drm->funcs->sync_end(drm->prime_fd);
+    // frames are compared as rgb, the vaapi paths never serve bgrx and fill the padding byte their own way
+    if (kmsvnc->bytes_per_pixel == BYTES_PER_PIXEL) {
+        uint32_t *px = (uint32_t*)buff;
+        for (size_t i = 0; i < (size_t)drm->mfb->width * drm->mfb->height; i++) {
+            uint32_t p = px[i] & 0xffffff;
+            px[i] = drm->server_bgrx ? (p & 0xff00) | p >> 16 | (p & 0xff) << 16 : p;
+        }
+    }
+    return 0;
+}
+
+// the frame every candidate has to reproduce, captured the way drm_vendor_setup() would
+static int drm_calibrate_reference(const char *driver_name, char *ref) {
+    int ret = drm_vendor_setup(driver_name) || drm_method_frame(ref);
+    drm_method_reset();
+    return ret;
+}
+
+// returns 0 with the best time per frame, 1 if the method is not available, 2 if its output differs from ref
+// only verifies the method when time is NULL
+static int drm_method_time(const struct drm_capture_method *method, const char *ref, char *buff, double *time) {
+    struct kmsvnc_drm_data *drm = kmsvnc->drm;
+    int ret = 1;
+    if (method->setup()) goto out;
+    if (drm_method_frame(buff)) goto out;
+    // vaapi quietly falls back to getimage when deriving does not work
+    if (method->setup == drm_method_vaapi_derive && !kmsvnc->va->derive_enabled) goto out;
+    ret = 2;
+    if (memcmp(buff, ref, (size_t)drm->mfb->width * drm->mfb->height * kmsvnc->bytes_per_pixel)) goto out;
+    ret = 0;
+    if (!time) goto out;
+    drm_probe_read();
+    *time = -1;
+    for (int i = 0; i < DRM_CALIBRATE_FRAMES; i++) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        drm->funcs->sync_start(drm->prime_fd);
+        drm->funcs->convert(drm->mapped, drm->mfb->width, drm->mfb->height, buff);
+        drm->funcs->sync_end(drm->prime_fd);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double t = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        if (*time < 0 || t < *time) *time = t;
+    }
+out:
+    drm_method_reset();
+    return ret;
+}
+
+static const struct drm_capture_method *drm_calibrate_cache_lookup(const char *driver_name) {
+    FILE *f = fopen(kmsvnc->calibrate_cache, "r");
+    if (!f) return NULL;
+    const struct drm_capture_method *found = NULL;
+    char line[256], driver[64], name[32];
+    uint64_t modifier;
+    uint32_t width, height;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%63s %" SCNx64 " %" SCNu32 "x%" SCNu32 " %31s", driver, &modifier, &width, &height, name) != 5) continue;
+        if (strcmp(driver, driver_name) || modifier != kmsvnc->drm->mfb->modifier ||
+            width != kmsvnc->drm->mfb->width || height != kmsvnc->drm->mfb->height) continue;
+        // the last matching line wins, so the file can simply be appended to
+        found = NULL;
+        for (int i = 0; i < KMSVNC_ARRAY_ELEMENTS(drm_capture_methods); i++) {
+            if (!strcmp(drm_capture_methods[i].name, name)) found = drm_capture_methods + i;
+        }
     }
+    fclose(f);
+    return found;
+}
+
+static void drm_calibrate_cache_store(const char *driver_name, const struct drm_capture_method *method) {
+    FILE *f = fopen(kmsvnc->calibrate_cache, "a");
+    if (!f) {
+        fprintf(stderr, "Failed to open %s: %s\n", kmsvnc->calibrate_cache, strerror(errno));
+        return;
+    }
+    fprintf(f, "%s 0x%" PRIx64 " %" PRIu32 "x%" PRIu32 " %s\n", driver_name, (uint64_t)kmsvnc->drm->mfb->modifier, kmsvnc->drm->mfb->width, kmsvnc->drm->mfb->height, method->name);
+    fclose(f);
+}
 
-    if (!drm->skip_map && !drm->mapped)
+// sets up the fastest capture method for the framebuffer, returns -1 to leave it to drm_vendor_setup()
+static int drm_calibrate(const char *driver_name) {
+    struct kmsvnc_drm_data *drm = kmsvnc->drm;
+    const struct drm_capture_method *best = NULL;
+
+    int candidates = 0;
+    for (int i = 0; i < KMSVNC_ARRAY_ELEMENTS(drm_capture_methods); i++) {
+        if (drm_method_applies(drm_capture_methods + i, driver_name)) candidates++;
+    }
+    if (candidates < 2) {
+        printf("calibrate: nothing to choose from for %s with this modifier\n", driver_name);
+        return -1;
+    }
+
+    size_t frame_size = (size_t)drm->mfb->width * drm->mfb->height * BYTES_PER_PIXEL;
+    char *buff = malloc(frame_size * 2);
+    if (!buff) KMSVNC_FATAL("memory allocation error at %s:%d\n", __FILE__, __LINE__);
+    char *ref = buff + frame_size;
+    if (drm_calibrate_reference(driver_name, ref)) {
+        printf("calibrate: the driver default cannot capture a reference frame\n");
+        free(buff);
+        return -1;
+    }
+
+    int va_derive_enabled = kmsvnc->va_derive_enabled;
+    const struct drm_capture_method *cached = kmsvnc->calibrate_cache ? drm_calibrate_cache_lookup(driver_name) : NULL;
+    if (cached && drm_method_applies(cached, driver_name)) {
+        // the cached choice still has to reproduce the driver default
+        int ret = drm_method_time(cached, ref, buff, NULL);
+        kmsvnc->va_derive_enabled = va_derive_enabled;
+        if (ret == 2 && !drm_calibrate_reference(driver_name, ref)) {
+            ret = drm_method_time(cached, ref, buff, NULL);
+            kmsvnc->va_derive_enabled = va_derive_enabled;
+        }
+        if (!ret) {
+            printf("calibrate: using %s from %s\n", cached->name, kmsvnc->calibrate_cache);
+            free(buff);
+            if (cached->setup()) return 1;
+            return 0;
+        }
+        printf("calibrate: %s from %s %s, calibrating again\n", cached->name, kmsvnc->calibrate_cache,
+            ret == 1 ? "is not available" : "output differs from the driver default");
+    }
+
+    double best_time = 0;
+    for (int i = 0; i < KMSVNC_ARRAY_ELEMENTS(drm_capture_methods); i++) {
+        const struct drm_capture_method *method = drm_capture_methods + i;
+        if (!drm_method_applies(method, driver_name)) continue;
+        double t;
+        int ret = drm_method_time(method, ref, buff, &t);
+        kmsvnc->va_derive_enabled = va_derive_enabled;
+        if (ret == 2 && !drm_calibrate_reference(driver_name, ref)) {
+            // the screen may have changed since the reference frame, try once more
+            ret = drm_method_time(method, ref, buff, &t);
+            kmsvnc->va_derive_enabled = va_derive_enabled;
+        }
+        if (ret == 1) {
+            printf("calibrate: %-14s not available\n", method->name);
+            continue;
+        }
+        if (ret == 2) {
+            printf("calibrate: %-14s output differs from the driver default, skipped\n", method->name);
+            continue;
+        }
+        printf("calibrate: %-14s %7.2f ms per frame\n", method->name, t * 1e3);
+        if (!best || t < best_time) {
+            best = method;
+            best_time = t;
+        }
+    }
+    free(buff);
+    if (!best) {
+        printf("calibrate: no method verified, falling back to the driver default\n");
+        return -1;
+    }
+
+    printf("calibrate: capturing with %s\n", best->name);
+    if (kmsvnc->calibrate_cache) drm_calibrate_cache_store(driver_name, best);
+    if (best->setup()) return 1;
+    return 0;
+}
+
+int drm_vendors() {
+    struct kmsvnc_drm_data *drm = kmsvnc->drm;
+
+    char *driver_name;
+    if (kmsvnc->force_driver) {
+        printf("using %s instead of %s\n", kmsvnc->force_driver, drm->drm_ver->name);
+        driver_name = kmsvnc->force_driver;
+    }
+    else {
+        driver_name = drm->drm_ver->name;
+    }
+
+    int calibrated = -1;
+    if (kmsvnc->calibrate) {
+        if (kmsvnc->force_driver) printf("not calibrating with a forced driver\n");
+        else calibrated = drm_calibrate(driver_name);
+    }
+    if (calibrated > 0) return 1;
+    if (calibrated < 0 && drm_vendor_setup(driver_name)) return 1;
+
+    // the tiled and vaapi paths only deal in 32 bit pixels
+    if (!drm->funcs->convert_linear) {
+        if (drm->src_bytes_per_pixel != BYTES_PER_PIXEL) {
+            KMSVNC_FATAL("16 bit framebuffers are only supported with a linear layout\n");
+        }
+        if (kmsvnc->bytes_per_pixel != BYTES_PER_PIXEL) {
+            printf("warn: 16 bpp is only supported for linear framebuffers, serving 32 bpp instead\n");
+            kmsvnc->bytes_per_pixel = BYTES_PER_PIXEL;
+        }
+    }
+    // only the linear deep path dithers, the tiled, vaapi and 16 bpp converts truncate
+    if (kmsvnc->dither && drm->funcs->convert != convert_deep) {
+        printf("warn: --dither needs a linear 10 bit framebuffer served at 32 bpp, it has no effect here\n");
+    }
+
+    if (drm_import()) return 1;
+    drm_fb_store();
+    drm_probe_read();
+
+    return 0;
+}
+
+// follow page flips: find the framebuffer currently on the plane, importing it on first sight
+int drm_refresh_fb() {
+    struct kmsvnc_drm_data *drm = kmsvnc->drm;
+
+    // drmModeGetPlane would do a second ioctl for the format list
+    struct drm_mode_get_plane get_plane;
+    memset(&get_plane, 0, sizeof(get_plane));
+    get_plane.plane_id = drm->plane->plane_id;
+    if (drmIoctl(drm->drm_fd, DRM_IOCTL_MODE_GETPLANE, &get_plane)) return 1;
+    if (!get_plane.fb_id) return 1;
+
+    drm->fb_cache_clock++;
+    if (drm->current_fb && drm->current_fb->fb_id == get_plane.fb_id) {
+        drm->current_fb->last_used = drm->fb_cache_clock;
+        return 0;
+    }
+    for (int i = 0; i < drm->fb_cache_count; i++) {
+        if (drm->fb_cache[i].fb_id == get_plane.fb_id) {
+            drm_fb_activate(drm->fb_cache + i);
+            drm->current_fb->last_used = drm->fb_cache_clock;
+            return 0;
+        }
+    }
+    struct kmsvnc_drm_failed_fb *failed = drm_failed_fb_find(get_plane.fb_id);
+    if (failed) {
+        failed->last_used = drm->fb_cache_clock;
+        // fb ids are reused once freed, so a failed one is looked at again now and then
+        if (drm->fb_cache_clock - failed->checked < DRM_FAILED_FB_RECHECK) return 1;
+        failed->checked = drm->fb_cache_clock;
+    }
+
+    drmModeFB2 *mfb = drmModeGetFB2(drm->drm_fd, get_plane.fb_id);
+    if (!mfb) return 1;
+    if (mfb->width != drm->mfb->width || mfb->height != drm->mfb->height ||
+        mfb->pixel_format != drm->mfb->pixel_format || mfb->modifier != drm->mfb->modifier ||
+        mfb->pitches[0] != drm->mfb->pitches[0] || !mfb->handles[0])
     {
-        printf("mapping with size = %lu, offset = %ld, fd = %d\n", drm->mmap_size, drm->mmap_offset, drm->mmap_fd);
-        drm->mapped = mmap(NULL, drm->mmap_size, PROT_READ, MAP_SHARED, drm->mmap_fd, drm->mmap_offset);
-        if (drm->mapped == MAP_FAILED)
-        {
-            KMSVNC_FATAL("Failed to mmap: %s\n", strerror(errno));
+        if (drm_failed_fb_store(mfb->fb_id)) {
+            fprintf(stderr, "Framebuffer %u does not match the layout of framebuffer %u, not capturing it\n", mfb->fb_id, drm->mfb->fb_id);
         }
+        drm_free_fb2(mfb);
+        return 1;
     }
 
+    KMSVNC_DEBUG("importing framebuffer %u\n", mfb->fb_id);
+    struct kmsvnc_drm_fb *prev = drm->current_fb;
+    drm->mfb = mfb;
+    if (drm_import()) {
+        struct kmsvnc_drm_fb failed;
+        drm_fb_save(&failed);
+        // a failed va import cleans up after itself and leaves the previous fb's va fields behind
+        if (prev && failed.va_surface_id == prev->va_surface_id) failed.va_surface_id = 0;
+        if (prev && failed.va_image == prev->va_image) {
+            failed.va_image = NULL;
+            failed.va_imgbuf = NULL;
+        }
+        drm_fb_release(&failed);
+        drm_fb_activate(prev);
+        drm_failed_fb_store(get_plane.fb_id);
+        return 1;
+    }
+    if (failed) failed->fb_id = 0;
+    drm_fb_store();
     return 0;
 }
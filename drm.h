@@ -10,4 +10,12 @@
 void drm_cleanup();
 int drm_open();
 int drm_vendors();
-int drm_dump_cursor_plane(char **data, int *width, int *height);
+int drm_refresh_fb();
+int drm_dump_cursor_plane(char **data, int *width, int *height, char reread);
+int drm_cursor_position(int *x, int *y);
+int drm_wait_vblank(unsigned int count);
+void detile_nvidia_x(const char *in, int width, int height, int pitch, char *buff, void (*row)(char *, const char *, size_t));
+void detile_intel_x(const char *in, int width, int height, int pitch, char *buff, void (*row)(char *, const char *, size_t));
+int drm_swizzle_setup(uint64_t modifier, struct kmsvnc_drm_swizzle *swizzle);
+void drm_swizzle_cleanup(struct kmsvnc_drm_swizzle *swizzle);
+void detile_swizzled(const struct kmsvnc_drm_swizzle *swizzle, const char *in, int width, int height, int pitch, char *buff);
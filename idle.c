@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "idle.h"
+
+extern struct kmsvnc_data *kmsvnc;
+
+#define IDLE_WAIT_CLIENT_NS 500000000
+#define IDLE_READY_WAIT_NS 4000000
+
+void idle_cleanup() {
+    if (kmsvnc->idle) {
+        pthread_cond_destroy(&kmsvnc->idle->cond);
+        pthread_mutex_destroy(&kmsvnc->idle->lock);
+        free(kmsvnc->idle);
+        kmsvnc->idle = NULL;
+    }
+}
+
+int idle_init() {
+    struct kmsvnc_idle_data *idle = malloc(sizeof(struct kmsvnc_idle_data));
+    if (!idle) KMSVNC_FATAL("memory allocation error at %s:%d\n", __FILE__, __LINE__);
+    memset(idle, 0, sizeof(struct kmsvnc_idle_data));
+    pthread_mutex_init(&idle->lock, NULL);
+    // between_frames() keeps its deadlines on the monotonic clock
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&idle->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    kmsvnc->idle = idle;
+    return 0;
+}
+
+// back to full rate, called from the input hooks on the server threads
+void idle_wakeup() {
+    struct kmsvnc_idle_data *idle = kmsvnc->idle;
+    pthread_mutex_lock(&idle->lock);
+    char was_idle = kmsvnc->vnc_opt->idle_frames && idle->unchanged_frames >= kmsvnc->vnc_opt->idle_frames;
+    idle->unchanged_frames = 0;
+    if (was_idle) pthread_cond_broadcast(&idle->cond);
+    pthread_mutex_unlock(&idle->lock);
+}
+
+void idle_frame(char changed) {
+    struct kmsvnc_idle_data *idle = kmsvnc->idle;
+    pthread_mutex_lock(&idle->lock);
+    if (changed) {
+        idle->unchanged_frames = 0;
+    }
+    else if (idle->unchanged_frames < kmsvnc->vnc_opt->idle_frames) {
+        if (++idle->unchanged_frames == kmsvnc->vnc_opt->idle_frames) {
+            KMSVNC_DEBUG("screen idle, capturing at the idle rate\n");
+        }
+    }
+    pthread_mutex_unlock(&idle->lock);
+}
+
+char idle_is_idle() {
+    if (!kmsvnc->vnc_opt->idle_frames) return 0;
+    return __atomic_load_n(&kmsvnc->idle->unchanged_frames, __ATOMIC_RELAXED) >= kmsvnc->vnc_opt->idle_frames;
+}
+
+// sleeps until the deadline, or until input arrives
+void idle_sleep_until(const struct timespec *deadline) {
+    struct kmsvnc_idle_data *idle = kmsvnc->idle;
+    pthread_mutex_lock(&idle->lock);
+    while (idle->unchanged_frames >= kmsvnc->vnc_opt->idle_frames && !kmsvnc->shutdown) {
+        if (pthread_cond_timedwait(&idle->cond, &idle->lock, deadline) == ETIMEDOUT) break;
+    }
+    pthread_mutex_unlock(&idle->lock);
+}
+
+// blocks the capture loop while nobody is watching
+void idle_wait_client() {
+    struct kmsvnc_idle_data *idle = kmsvnc->idle;
+    struct timespec deadline;
+    pthread_mutex_lock(&idle->lock);
+    while (!idle->clients && !kmsvnc->shutdown && rfbIsActive(kmsvnc->server)) {
+        // the signal handler cannot take the lock, poll for shutdown now and then
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += IDLE_WAIT_CLIENT_NS;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&idle->cond, &idle->lock, &deadline);
+    }
+    pthread_mutex_unlock(&idle->lock);
+}
+
+// a client is ready once it has a FramebufferUpdateRequest we have not answered yet
+static char idle_client_ready() {
+    char ready = 0;
+    rfbClientIteratorPtr iter = rfbGetClientIterator(kmsvnc->server);
+    rfbClientPtr cl;
+    while (!ready && (cl = rfbClientIteratorNext(iter))) {
+        LOCK(cl->updateMutex);
+        ready = !sraRgnEmpty(cl->requestedRegion);
+        UNLOCK(cl->updateMutex);
+    }
+    rfbReleaseClientIterator(iter);
+    return ready;
+}
+
+// skip capturing while every client is still draining its previous update
+void idle_wait_ready() {
+    struct kmsvnc_idle_data *idle = kmsvnc->idle;
+    while (__atomic_load_n(&idle->clients, __ATOMIC_RELAXED) && !kmsvnc->shutdown && rfbIsActive(kmsvnc->server)) {
+        pthread_mutex_lock(&idle->lock);
+        unsigned int requests = idle->requests;
+        pthread_mutex_unlock(&idle->lock);
+        if (idle_client_ready()) return;
+
+        // woken by idle_update_request_hook(), the timeout covers shutdown and clients leaving
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += IDLE_READY_WAIT_NS;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_mutex_lock(&idle->lock);
+        while (idle->requests == requests && !kmsvnc->shutdown) {
+            if (pthread_cond_timedwait(&idle->cond, &idle->lock, &deadline) == ETIMEDOUT) break;
+        }
+        char requested = idle->requests != requests;
+        pthread_mutex_unlock(&idle->lock);
+        // the hook runs before libvncserver adds the request to requestedRegion, so do not look again
+        if (requested) return;
+    }
+}
+
+static void idle_update_request_hook(rfbClientPtr cl, rfbFramebufferUpdateRequestMsg *fur) {
+    struct kmsvnc_idle_data *idle = kmsvnc->idle;
+    pthread_mutex_lock(&idle->lock);
+    idle->requests++;
+    pthread_cond_broadcast(&idle->cond);
+    pthread_mutex_unlock(&idle->lock);
+}
+
+static void idle_client_gone_hook(rfbClientPtr cl) {
+    struct kmsvnc_idle_data *idle = kmsvnc->idle;
+    pthread_mutex_lock(&idle->lock);
+    idle->clients--;
+    pthread_mutex_unlock(&idle->lock);
+    // a new client may be allocated at the same address
+    rfbClientPtr gone = cl;
+    __atomic_compare_exchange_n(&kmsvnc->pointer_client, &gone, NULL, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+enum rfbNewClientAction idle_new_client_hook(rfbClientPtr cl) {
+    struct kmsvnc_idle_data *idle = kmsvnc->idle;
+    cl->clientGoneHook = idle_client_gone_hook;
+    cl->clientFramebufferUpdateRequestHook = idle_update_request_hook;
+    pthread_mutex_lock(&idle->lock);
+    idle->clients++;
+    // a new viewer wants a fresh frame at full rate
+    idle->unchanged_frames = 0;
+    pthread_cond_broadcast(&idle->cond);
+    pthread_mutex_unlock(&idle->lock);
+    return RFB_CLIENT_ACCEPT;
+}
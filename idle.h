@@ -0,0 +1,13 @@
+#pragma once
+
+#include "kmsvnc.h"
+
+void idle_cleanup();
+int idle_init();
+void idle_wakeup();
+void idle_frame(char changed);
+char idle_is_idle();
+void idle_sleep_until(const struct timespec *deadline);
+void idle_wait_client();
+void idle_wait_ready();
+enum rfbNewClientAction idle_new_client_hook(rfbClientPtr cl);
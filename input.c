@@ -2,10 +2,12 @@
 #include <fcntl.h>
 #include <linux/uinput.h>
 #include <math.h>
+#include <time.h>
 #include <stdlib.h>
 
 #include "input.h"
 #include "keymap.h"
+#include "idle.h"
 
 extern struct kmsvnc_data *kmsvnc;
 
@@ -95,6 +97,7 @@ int uinput_init()
 
 void rfb_key_hook(rfbBool down, rfbKeySym keysym, rfbClientPtr cl)
 {
+    idle_wakeup();
     struct key_iter_search search = {
         .keysym = keysym,
         .keycode = XKB_KEYCODE_INVALID,
@@ -139,6 +142,11 @@ void rfb_key_hook(rfbBool down, rfbKeySym keysym, rfbClientPtr cl)
 
 void rfb_ptr_hook(int mask, int screen_x, int screen_y, rfbClientPtr cl)
 {
+    idle_wakeup();
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    __atomic_store_n(&kmsvnc->pointer_time_ns, (int64_t)now.tv_sec * 1000000000ll + now.tv_nsec, __ATOMIC_RELAXED);
+    __atomic_store_n(&kmsvnc->pointer_client, cl, __ATOMIC_RELAXED);
     // printf("pointer to %d, %d\n", screen_x, screen_y);
     float global_x = (float)(screen_x + kmsvnc->input_offx);
     float global_y = (float)(screen_y + kmsvnc->input_offy);
@@ -1,5 +1,6 @@
 #define _GNU_SOURCE
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
@@ -15,6 +16,13 @@
 #include "input.h"
 #include "drm.h"
 #include "va.h"
+#include "damage.h"
+#include "simd.h"
+#include "pool.h"
+#include "idle.h"
+#include "motion.h"
+#include "cursor.h"
+#include "bench.h"
 
 struct kmsvnc_data *kmsvnc = NULL;
 
@@ -22,157 +30,178 @@ struct kmsvnc_data *kmsvnc = NULL;
 
 static void between_frames()
 {
-    static struct timespec now = {0, 0}, then = {0, 0}, tmp = {0, 0};
+    static struct timespec deadline = {0, 0};
+    static char vblank_failed = 0;
+    struct timespec now;
+
+    if (kmsvnc->vnc_opt->vblank_divisor && !idle_is_idle()) {
+        if (!drm_wait_vblank(kmsvnc->vnc_opt->vblank_divisor)) {
+            vblank_failed = 0;
+            return;
+        }
+        if (!vblank_failed) {
+            vblank_failed = 1;
+            KMSVNC_DEBUG("waiting for vblank failed, pacing with --fps until it works again\n");
+        }
+    }
 
     clock_gettime(CLOCK_MONOTONIC, &now);
-    memcpy((char *)&then, (char *)&tmp, sizeof(struct timespec));
-    tmp.tv_nsec += kmsvnc->vnc_opt->sleep_ns;
-    if (tmp.tv_nsec >= NS_IN_S)
+    if (idle_is_idle()) {
+        // nothing changed for a while, poll slowly until input or a change shows up
+        memcpy((char *)&deadline, (char *)&now, sizeof(struct timespec));
+        deadline.tv_nsec += kmsvnc->vnc_opt->idle_sleep_ns;
+        deadline.tv_sec += deadline.tv_nsec / NS_IN_S;
+        deadline.tv_nsec %= NS_IN_S;
+        idle_sleep_until(&deadline);
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        return;
+    }
+    deadline.tv_nsec += kmsvnc->vnc_opt->sleep_ns;
+    if (deadline.tv_nsec >= NS_IN_S)
     {
-        tmp.tv_sec++;
-        tmp.tv_nsec %= NS_IN_S;
+        deadline.tv_sec++;
+        deadline.tv_nsec -= NS_IN_S;
     }
-    if (now.tv_sec < tmp.tv_sec || (now.tv_sec == tmp.tv_sec && now.tv_nsec < tmp.tv_nsec))
+    if (deadline.tv_sec < now.tv_sec || (deadline.tv_sec == now.tv_sec && deadline.tv_nsec <= now.tv_nsec))
     {
-        then.tv_sec = tmp.tv_sec - now.tv_sec;
-        then.tv_nsec = tmp.tv_nsec - now.tv_nsec;
-        if (then.tv_nsec < 0)
-        {
-            then.tv_sec--;
-            then.tv_nsec += NS_IN_S;
-        }
-        nanosleep(&then, &then);
+        // fell behind, start over from now instead of capturing a burst of frames to catch up
+        memcpy((char *)&deadline, (char *)&now, sizeof(struct timespec));
+        return;
     }
-    memcpy((char *)&now, (char *)&then, sizeof(struct timespec));
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
 }
 
-static void update_screen_buf(char* to, char *from, int width, int height) {
-    uint64_t *double_pix_from = (uint64_t *)from;
-    uint64_t *double_pix_to = (uint64_t *)to;
-    int min_x = INT32_MAX;
-    int min_y = INT32_MAX;
-    int max_x = -1;
-    int max_y = -1;
-    if (!kmsvnc->vnc_opt->disable_cmpfb && width % 2 == 0) {
-        for (int y = 0; y < height; y++) {
-            for (int x = 0; x < width; x+=2) {
-                if (*double_pix_from != *double_pix_to) {
-                    if (x < min_x) {
-                        min_x = x;
-                    }
-                    if (x > max_x) {
-                        max_x = x;
-                    }
-                    if (y < min_y) {
-                        min_y = y;
-                    }
-                    if (y > max_y) {
-                        max_y = y;
-                    }
-                }
-                double_pix_from ++;
-                double_pix_to ++;
-            }
+// holds every client between updates, so swapping the buffers never mixes two frames into one update
+static int lock_clients() {
+    int count = 0;
+    rfbClientIteratorPtr iter = rfbGetClientIterator(kmsvnc->server);
+    rfbClientPtr cl;
+    while ((cl = rfbClientIteratorNext(iter))) {
+        if (count >= kmsvnc->locked_clients_len) {
+            int len = kmsvnc->locked_clients_len ? kmsvnc->locked_clients_len * 2 : 8;
+            rfbClientPtr *locked_clients = realloc(kmsvnc->locked_clients, sizeof(rfbClientPtr) * len);
+            if (!locked_clients) break;
+            kmsvnc->locked_clients = locked_clients;
+            kmsvnc->locked_clients_len = len;
         }
+        rfbIncrClientRef(cl);
+        LOCK(cl->sendMutex);
+        kmsvnc->locked_clients[count++] = cl;
     }
-    else {
-        memcpy(to, from, width * height * BYTES_PER_PIXEL);
-        rfbMarkRectAsModified(kmsvnc->server, 0, 0, width, height);
-        return;
-    }
-    max_x = max_x < 0 ? 0 : max_x;
-    max_y = max_y < 0 ? 0 : max_y;
-    min_x = min_x > width ? 0 : min_x;
-    min_y = min_y > height ? 0 : min_y;
-
-    //printf("dirty: %d, %d, %d, %d\n", min_x, min_y, max_x, max_y);
-    if (max_x || max_y || min_x || min_y) {
-        memcpy(to, from, width * height * BYTES_PER_PIXEL);
-        rfbMarkRectAsModified(kmsvnc->server, min_x, min_y, max_x + 2, max_y + 1);
+    rfbReleaseClientIterator(iter);
+    return count;
+}
+static void unlock_clients(int count) {
+    for (int i = 0; i < count; i++) {
+        UNLOCK(kmsvnc->locked_clients[i]->sendMutex);
+        rfbDecrClientRef(kmsvnc->locked_clients[i]);
     }
 }
+// must be called with every client's sendMutex held
+static void swap_screen_buf() {
+    char *tmp = kmsvnc->buf;
+    kmsvnc->buf = kmsvnc->buf2;
+    kmsvnc->buf2 = tmp;
+    kmsvnc->server->frameBuffer = kmsvnc->buf;
+}
 
-static inline void update_vnc_cursor(char *data, int width, int height) {
-    uint8_t r, g, b, a;
-    #define CURSOR_MIN_A 160 // ~63%
-    int min_x = width;
-    int max_x = -1;
-    int min_y = height;
-    int max_y = -1;
-    int x, y;
-
-    for (int i = 0; i < width * height * BYTES_PER_PIXEL; i += BYTES_PER_PIXEL) {
-        uint32_t pixdata = htonl(*((uint32_t*)(data + i)));
-        //r = (pixdata & 0xff000000u) >> 24;
-        //g = (pixdata & 0x00ff0000u) >> 16;
-        //b = (pixdata & 0x0000ff00u) >> 8;
-        a = pixdata & 0xff;
-        if (a > CURSOR_MIN_A) {
-            x = (i / BYTES_PER_PIXEL) % width;
-            y = (i / BYTES_PER_PIXEL) / width;
-            if (x < min_x) min_x = x;
-            if (y < min_y) min_y = y;
-            if (x > max_x) max_x = x;
-            if (y > max_y) max_y = y;
+static int dirty_tiles = 0;
+static char probing = 0;
+
+static void capture_band(int band) {
+    int width = kmsvnc->drm->mfb->width;
+    int height = kmsvnc->drm->mfb->height;
+    int y = band * DAMAGE_TILE_SIZE;
+    int rows = height - y < DAMAGE_TILE_SIZE ? height - y : DAMAGE_TILE_SIZE;
+    int src_bpp = kmsvnc->drm->src_bytes_per_pixel;
+    size_t src_pitch = kmsvnc->drm->mfb->pitches[0];
+    size_t offset = (size_t)y * width * kmsvnc->bytes_per_pixel;
+
+    if (probing) {
+        // only read tiles whose sampled rows changed, the mapping may well be uncached
+        if (!damage_probe(kmsvnc->drm->mapped, src_pitch, src_bpp, kmsvnc->buf1, kmsvnc->buf2, width, height, band, kmsvnc->drm->funcs->convert)) {
+            memset(kmsvnc->damage->tiles + band * kmsvnc->damage->tiles_x, 0, kmsvnc->damage->tiles_x);
+            return;
         }
+        damage_convert(kmsvnc->drm->mapped, src_pitch, src_bpp, kmsvnc->buf1, width, height, band, kmsvnc->drm->funcs->convert);
     }
-    if (min_x > max_x || min_y > max_y) {
-        // no cursor detected
-        return;
+    else if (kmsvnc->drm->funcs->convert_linear) {
+        kmsvnc->drm->funcs->convert(kmsvnc->drm->mapped + (size_t)y * src_pitch, width, rows, kmsvnc->buf1 + offset);
     }
-    int rwidth = max_x - min_x + 1;
-    int rheight = max_y - min_y + 1;
-    if (kmsvnc->cursor_bitmap_len < rwidth * rheight * BYTES_PER_PIXEL)
-    {
-        if (kmsvnc->cursor_bitmap)
-            free(kmsvnc->cursor_bitmap);
-        kmsvnc->cursor_bitmap = malloc(rwidth * rheight * BYTES_PER_PIXEL);
-        if (!kmsvnc->cursor_bitmap) return;
-        kmsvnc->cursor_bitmap_len = rwidth * rheight * BYTES_PER_PIXEL;
-    }
-    unsigned char *rich_source = malloc(rwidth * rheight * BYTES_PER_PIXEL);
-    if (!rich_source) return;
-    char *maskString = malloc(rwidth * rheight);
-    if (!maskString) {
-        free(rich_source);
+    if (kmsvnc->vnc_opt->disable_cmpfb) {
+        memcpy(kmsvnc->buf2 + offset, kmsvnc->buf1 + offset, rows * width * kmsvnc->bytes_per_pixel);
+    }
+    else {
+        int dirty = damage_update(kmsvnc->buf2, kmsvnc->buf1, width, height, band, probing);
+        __atomic_fetch_add(&dirty_tiles, dirty, __ATOMIC_RELAXED);
+    }
+}
+
+// tiled sources are compared per source tile and only changed tiles are detiled, straight into the back buffer
+static void capture_tiled_band(int band) {
+    int dirty = kmsvnc->drm->funcs->diff(kmsvnc->drm->mapped, kmsvnc->drm->mfb->width, kmsvnc->drm->mfb->height, band, kmsvnc->buf2);
+    __atomic_fetch_add(&dirty_tiles, dirty, __ATOMIC_RELAXED);
+}
+
+static void update_screen_buf(int width, int height) {
+    if (kmsvnc->vnc_opt->disable_cmpfb) {
+        int count = lock_clients();
+        swap_screen_buf();
+        unlock_clients(count);
+        rfbMarkRectAsModified(kmsvnc->server, 0, 0, width, height);
         return;
     }
-    memset(maskString, ' ', rwidth * rheight);
-    for (int i = 0; i < rwidth; i++) {
-        for (int j = 0; j < rheight; j++) {
-            int t = (i + j * rwidth) * BYTES_PER_PIXEL;
-            int s = ((i+min_x) + (j+min_y) * width) * BYTES_PER_PIXEL;
-            *((uint32_t*)(rich_source + t)) = *((uint32_t*)(data + s));
-            if ((uint8_t)*(rich_source + t + 3) > CURSOR_MIN_A) {
-                maskString[i + j * rwidth] = 'x';
-            }
+    // the back buffer always holds the same frame as the front buffer before capture_band()
+    if (dirty_tiles) {
+        // buf still holds the previous frame, buf2 the new one
+        char moved = !kmsvnc->vnc_opt->disable_copyrect && motion_detect(kmsvnc->buf, kmsvnc->buf2, width, height);
+        int count = lock_clients();
+        swap_screen_buf();
+        // bring the retired front buffer up to date, only dirty tiles differ.
+        // done before unlocking, while no client has the cursor drawn into the front buffer
+        damage_reconcile(kmsvnc->buf2, kmsvnc->buf, width, height);
+        unlock_clients(count);
+        if (moved) {
+            struct kmsvnc_damage_rect copied = {kmsvnc->motion->x1, kmsvnc->motion->y1, kmsvnc->motion->x2, kmsvnc->motion->y2};
+            motion_schedule(kmsvnc->server);
+            damage_report(kmsvnc->server, width, height, &copied);
+        }
+        else {
+            damage_report(kmsvnc->server, width, height, NULL);
         }
     }
+}
 
-    if ((kmsvnc->server->cursor->width != rwidth || kmsvnc->server->cursor->height != rheight) || memcmp(kmsvnc->cursor_bitmap, rich_source, rwidth * rheight * BYTES_PER_PIXEL)) {
-        KMSVNC_DEBUG("cursor update %dx%d\n", rwidth, rheight);
-        memcpy(kmsvnc->cursor_bitmap, rich_source, kmsvnc->cursor_bitmap_len);
-        char *cursorString = malloc(rwidth * rheight);
-        if (!cursorString) {
-            free(rich_source);
-            free(maskString);
-            return;
-        }
+// converts and diffs the frame in bands of one tile row
+static void capture_frame() {
+    int width = kmsvnc->drm->mfb->width;
+    int height = kmsvnc->drm->mfb->height;
 
-        memset(cursorString, 'x', rwidth * rheight);
+    static struct kmsvnc_drm_fb *last_fb = NULL;
 
-        rfbCursorPtr cursor = rfbMakeXCursor(rwidth, rheight, cursorString, maskString);
-        free(cursorString);
-        cursor->richSource = rich_source;
-        cursor->cleanupRichSource = TRUE;
-        cursor->xhot = 0;
-        cursor->yhot = 0;
-        rfbSetCursor(kmsvnc->server, cursor);
+    if (drm_refresh_fb()) return;
+    probing = kmsvnc->drm->funcs->convert_linear && !kmsvnc->vnc_opt->disable_cmpfb && kmsvnc->vnc_opt->probe_sweep;
+    if (probing) {
+        // after a page flip the new buffer may differ anywhere
+        damage_probe_begin(kmsvnc->drm->current_fb != last_fb);
+        last_fb = kmsvnc->drm->current_fb;
+    }
+    kmsvnc->drm->funcs->sync_start(kmsvnc->drm->prime_fd);
+    dirty_tiles = 0;
+    if (kmsvnc->drm->funcs->diff && !kmsvnc->vnc_opt->disable_cmpfb) {
+        damage_clear();
+        int rows = kmsvnc->drm->funcs->diff_rows;
+        pool_run((height + rows - 1) / rows, capture_tiled_band);
     }
     else {
-        free(rich_source);
-        free(maskString);
+        if (!kmsvnc->drm->funcs->convert_linear) {
+            kmsvnc->drm->funcs->convert(kmsvnc->drm->mapped, width, height, kmsvnc->buf1);
+        }
+        pool_run(kmsvnc->damage->tiles_y, capture_band);
     }
+    kmsvnc->drm->funcs->sync_end(kmsvnc->drm->prime_fd);
+    update_screen_buf(width, height);
+    idle_frame(kmsvnc->vnc_opt->disable_cmpfb || dirty_tiles);
 }
 
 static void cleanup() {
@@ -188,6 +217,24 @@ static void cleanup() {
     if (kmsvnc->va) {
         va_cleanup();
     }
+    if (kmsvnc->damage) {
+        damage_cleanup();
+    }
+    if (kmsvnc->pool) {
+        pool_cleanup();
+    }
+    if (kmsvnc->idle) {
+        idle_cleanup();
+    }
+    if (kmsvnc->motion) {
+        motion_cleanup();
+    }
+    if (kmsvnc->cursor) {
+        cursor_cleanup();
+    }
+    if (kmsvnc->simd) {
+        simd_cleanup();
+    }
     if (kmsvnc) {
         if (kmsvnc->vnc_opt) {
             free(kmsvnc->vnc_opt);
@@ -201,11 +248,15 @@ static void cleanup() {
             free(kmsvnc->buf);
             kmsvnc->buf = NULL;
         }
-        if (kmsvnc->cursor_bitmap) {
-            free(kmsvnc->cursor_bitmap);
-            kmsvnc->cursor_bitmap = NULL;
+        if (kmsvnc->buf2) {
+            free(kmsvnc->buf2);
+            kmsvnc->buf2 = NULL;
+        }
+        if (kmsvnc->locked_clients) {
+            free(kmsvnc->locked_clients);
+            kmsvnc->locked_clients = NULL;
         }
-        kmsvnc->cursor_bitmap_len = 0;
+        kmsvnc->locked_clients_len = 0;
         free(kmsvnc);
         kmsvnc = NULL;
     }
@@ -232,12 +283,25 @@ static struct argp_option kmsvnc_main_options[] = {
     {"port", 'p', "5900", 0, "Listen port"},
     {"disable-ipv6", '4', 0, OPTION_ARG_OPTIONAL, "Disable ipv6"},
     {"fps", 0xff00, "30", 0, "Target frames per second"},
+    {"idle-fps", 0xff11, "2", 0, "Frames per second to capture at while the screen is idle"},
+    {"idle-frames", 0xff12, "60", 0, "Unchanged frames before dropping to --idle-fps, 0 to always capture at full rate"},
+    {"probe-sweep", 0xff13, "30", 0, "Compare only sampled rows of each tile and every Nth frame in full, 0 to always compare the full frame"},
+    {"vblank", 0xff10, "0", 0, "Capture on every Nth vblank of the crtc instead of pacing with --fps, 0 to disable"},
+    {"fence-timeout", 0xff1b, "16", 0, "Milliseconds to wait for rendering into a prime framebuffer to finish before reading it, 0 to disable"},
     {"disable-always-shared", 0xff01, 0, OPTION_ARG_OPTIONAL, "Do not always treat incoming connections as shared"},
     {"disable-compare-fb", 0xff02, 0, OPTION_ARG_OPTIONAL, "Do not compare pixels"},
+    {"disable-copyrect", 0xff14, 0, OPTION_ARG_OPTIONAL, "Do not detect scrolling and moved areas"},
+    {"server-bpp", 0xff17, "32", 0, "Bits per pixel of the served framebuffer, 32 or 16 (rgb565, linear framebuffers only)"},
+    {"dither", 0xff16, 0, OPTION_ARG_OPTIONAL, "Dither 10 bit framebuffers down to 8 bits instead of truncating (linear framebuffers served at 32 bpp only)"},
     {"capture-cursor", 'c', 0, OPTION_ARG_OPTIONAL, "Capture mouse cursor"},
+    {"composite-cursor", 0xff1c, 0, OPTION_ARG_OPTIONAL, "Alpha blend the captured cursor into updates, server wide for every client without cursor shape support, implies --capture-cursor"},
     {"capture-raw-fb", 0xff03, "/tmp/rawfb.bin", 0, "Capture RAW framebuffer instead of starting the vnc server (for debugging)"},
     {"va-derive", 0xff04, "off", 0, "Enable derive with vaapi"},
+    {"cpu-detile", 0xff18, 0, OPTION_ARG_OPTIONAL, "Detile intel y-tiled/tile4 and amd 64k_s framebuffers on the cpu instead of with vaapi"},
+    {"calibrate", 0xff19, 0, OPTION_ARG_OPTIONAL, "Time every capture method that works for the framebuffer and use the fastest"},
+    {"calibrate-cache", 0xff1a, "/var/cache/kmsvnc-calibrate", 0, "Remember --calibrate results per driver, modifier and resolution in a file, implies --calibrate"},
     {"debug", 0xff05, 0, OPTION_ARG_OPTIONAL, "Print debug message"},
+    {"bench", 0xff15, 0, OPTION_ARG_OPTIONAL, "Check and time the conversion kernels, then exit (for debugging)"},
     {"input-width", 0xff06, "0", 0, "Explicitly set input width, normally this is inferred from screen width on a single display system"},
     {"input-height", 0xff07, "0", 0, "Explicitly set input height"},
     {"input-offx", 0xff08, "0", 0, "Set input offset of x axis on a multi display system"},
@@ -251,6 +315,8 @@ static struct argp_option kmsvnc_main_options[] = {
     {"disable-input", 'i', 0, OPTION_ARG_OPTIONAL, "Disable uinput"},
     {"desktop-name", 'n', "kmsvnc", 0, "Specify vnc desktop name"},
     {"password-file", 0xff0d, "", 0, "File containing password (max 8 characters)"},
+    {"simd", 0xff0e, "auto", 0, "Force a simd level (auto, avx512, avx2, sse4.1, sse2, neon, scalar)"},
+    {"threads", 0xff0f, "0", 0, "Number of capture threads, 0 to pick from the number of cpus"},
     {0}
 };
 
@@ -303,15 +369,77 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
                 }
             }
             break;
+        case 0xff10:
+            {
+                int divisor = atoi(arg);
+                if (divisor >= 0) {
+                    kmsvnc->vnc_opt->vblank_divisor = divisor;
+                }
+                else {
+                    argp_error(state, "invalid vblank divisor %s", arg);
+                }
+            }
+            break;
+        case 0xff1b:
+            {
+                int timeout = atoi(arg);
+                if (timeout >= 0) {
+                    kmsvnc->vnc_opt->fence_timeout_ms = timeout;
+                }
+                else {
+                    argp_error(state, "invalid fence timeout %s", arg);
+                }
+            }
+            break;
+        case 0xff11:
+            {
+                int fps = atoi(arg);
+                if (fps > 0 && fps < 1000) {
+                    kmsvnc->vnc_opt->idle_sleep_ns = NS_IN_S / fps;
+                }
+                else {
+                    argp_error(state, "invalid idle fps %s", arg);
+                }
+            }
+            break;
+        case 0xff12:
+            {
+                int frames = atoi(arg);
+                if (frames >= 0) {
+                    kmsvnc->vnc_opt->idle_frames = frames;
+                }
+                else {
+                    argp_error(state, "invalid idle frame count %s", arg);
+                }
+            }
+            break;
+        case 0xff13:
+            {
+                int frames = atoi(arg);
+                if (frames >= 0) {
+                    kmsvnc->vnc_opt->probe_sweep = frames;
+                }
+                else {
+                    argp_error(state, "invalid probe sweep interval %s", arg);
+                }
+            }
+            break;
         case 0xff01:
             kmsvnc->vnc_opt->always_shared = 0;
             break;
         case 0xff02:
             kmsvnc->vnc_opt->disable_cmpfb = 1;
             break;
+        case 0xff14:
+            kmsvnc->vnc_opt->disable_copyrect = 1;
+            break;
         case 'c':
             kmsvnc->capture_cursor = 1;
             break;
+        case 0xff1c:
+            kmsvnc->capture_cursor = 1;
+            kmsvnc->composite_cursor = 1;
+            break;
         case 0xff03:
             kmsvnc->debug_capture_fb = arg;
             kmsvnc->disable_input = 1;
@@ -327,6 +455,33 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
         case 0xff05:
             kmsvnc->debug_enabled = 1;
             break;
+        case 0xff15:
+            kmsvnc->bench = 1;
+            break;
+        case 0xff16:
+            kmsvnc->dither = 1;
+            break;
+        case 0xff18:
+            kmsvnc->cpu_detile = 1;
+            break;
+        case 0xff19:
+            kmsvnc->calibrate = 1;
+            break;
+        case 0xff1a:
+            kmsvnc->calibrate = 1;
+            kmsvnc->calibrate_cache = arg;
+            break;
+        case 0xff17:
+            {
+                int bpp = atoi(arg);
+                if (bpp == 32 || bpp == 16) {
+                    kmsvnc->bytes_per_pixel = bpp / 8;
+                }
+                else {
+                    argp_error(state, "invalid server bpp %s, must be 32 or 16", arg);
+                }
+            }
+            break;
         case 0xff06:
             {
                 int width = atoi(arg);
@@ -371,6 +526,20 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
         case 0xff0d:
             kmsvnc->vnc_opt->password_file = arg;
             break;
+        case 0xff0e:
+            kmsvnc->simd_level = arg;
+            break;
+        case 0xff0f:
+            {
+                int threads = atoi(arg);
+                if (threads >= 0) {
+                    kmsvnc->threads = threads;
+                }
+                else {
+                    argp_error(state, "invalid thread count %s", arg);
+                }
+            }
+            break;
         case 'w':
             kmsvnc->input_wakeup = 1;
             break;
@@ -408,10 +577,15 @@ int main(int argc, char **argv)
     static char device_example[DEVICE_EXAMPLE_MAX_SIZE] = DEVICE_EXAMPLE_FALLBACK;
     kmsvnc->card = device_example;
     kmsvnc->va_derive_enabled = -1;
+    kmsvnc->bytes_per_pixel = BYTES_PER_PIXEL;
     kmsvnc->vnc_opt->bind = &(struct in_addr){0};
     kmsvnc->vnc_opt->always_shared = 1;
     kmsvnc->vnc_opt->port = 5900;
     kmsvnc->vnc_opt->sleep_ns = NS_IN_S / 30;
+    kmsvnc->vnc_opt->idle_sleep_ns = NS_IN_S / 2;
+    kmsvnc->vnc_opt->idle_frames = 60;
+    kmsvnc->vnc_opt->probe_sweep = 30;
+    kmsvnc->vnc_opt->fence_timeout_ms = 16;
     kmsvnc->vnc_opt->desktop_name = "kmsvnc";
 
     static char *args_doc = "";
@@ -432,6 +606,16 @@ int main(int argc, char **argv)
         }
     }
 
+    if (simd_init()) {
+        cleanup();
+        return 1;
+    }
+    if (kmsvnc->bench) {
+        int err = bench_run();
+        cleanup();
+        return err;
+    }
+
     if (!kmsvnc->disable_input) {
         const char* XKB_DEFAULT_LAYOUT = getenv("XKB_DEFAULT_LAYOUT");
         if (!XKB_DEFAULT_LAYOUT || strcmp(XKB_DEFAULT_LAYOUT, "") == 0) {
@@ -496,7 +680,7 @@ int main(int argc, char **argv)
         return 0;
     }
 
-    size_t buflen = kmsvnc->drm->mfb->width * kmsvnc->drm->mfb->height * BYTES_PER_PIXEL;
+    size_t buflen = kmsvnc->drm->mfb->width * kmsvnc->drm->mfb->height * kmsvnc->bytes_per_pixel;
     kmsvnc->buf = malloc(buflen);
     if (!kmsvnc->buf) {
         cleanup();
@@ -509,16 +693,64 @@ int main(int argc, char **argv)
         KMSVNC_FATAL("memory allocation error at %s:%d\n", __FILE__, __LINE__);
     }
     memset(kmsvnc->buf1, 0, buflen);
+    kmsvnc->buf2 = malloc(buflen);
+    if (!kmsvnc->buf2) {
+        cleanup();
+        KMSVNC_FATAL("memory allocation error at %s:%d\n", __FILE__, __LINE__);
+    }
+    memset(kmsvnc->buf2, 0, buflen);
+    if (damage_init(kmsvnc->drm->mfb->width, kmsvnc->drm->mfb->height)) {
+        cleanup();
+        return 1;
+    }
+    if (pool_init(kmsvnc->threads)) {
+        cleanup();
+        return 1;
+    }
+    if (idle_init()) {
+        cleanup();
+        return 1;
+    }
+    if (motion_init(kmsvnc->drm->mfb->width, kmsvnc->drm->mfb->height)) {
+        cleanup();
+        return 1;
+    }
+    if (kmsvnc->capture_cursor && cursor_init()) {
+        cleanup();
+        return 1;
+    }
 
     signal(SIGHUP, &signal_handler);
     signal(SIGINT, &signal_handler);
     signal(SIGTERM, &signal_handler);
 
-    kmsvnc->server = rfbGetScreen(0, NULL, kmsvnc->drm->mfb->width, kmsvnc->drm->mfb->height, 8, 3, 4);
+    if (kmsvnc->bytes_per_pixel == 2) {
+        kmsvnc->server = rfbGetScreen(0, NULL, kmsvnc->drm->mfb->width, kmsvnc->drm->mfb->height, 5, 3, 2);
+    }
+    else {
+        kmsvnc->server = rfbGetScreen(0, NULL, kmsvnc->drm->mfb->width, kmsvnc->drm->mfb->height, 8, 3, 4);
+    }
     if (!kmsvnc->server) {
         cleanup();
         return 1;
     }
+    if (kmsvnc->bytes_per_pixel == 2) {
+        // rfbGetScreen() sets up rgb555, the buffers hold rgb565
+        kmsvnc->server->depth = 16;
+        kmsvnc->server->serverFormat.depth = 16;
+        kmsvnc->server->serverFormat.redMax = 31;
+        kmsvnc->server->serverFormat.greenMax = 63;
+        kmsvnc->server->serverFormat.blueMax = 31;
+        kmsvnc->server->serverFormat.redShift = 11;
+        kmsvnc->server->serverFormat.greenShift = 5;
+        kmsvnc->server->serverFormat.blueShift = 0;
+    }
+    else if (kmsvnc->drm->server_bgrx) {
+        // clients asking for another layout are translated by libvncserver
+        kmsvnc->server->serverFormat.redShift = 16;
+        kmsvnc->server->serverFormat.greenShift = 8;
+        kmsvnc->server->serverFormat.blueShift = 0;
+    }
     kmsvnc->server->desktopName = kmsvnc->vnc_opt->desktop_name;
     kmsvnc->server->frameBuffer = kmsvnc->buf;
     kmsvnc->server->port = kmsvnc->vnc_opt->port;
@@ -526,6 +758,7 @@ int main(int argc, char **argv)
     kmsvnc->server->ipv6port = kmsvnc->vnc_opt->disable_ipv6 ? 0 : kmsvnc->vnc_opt->port;
     kmsvnc->server->listen6Interface = kmsvnc->vnc_opt->bind6;
     kmsvnc->server->alwaysShared = kmsvnc->vnc_opt->always_shared;
+    kmsvnc->server->newClientHook = idle_new_client_hook;
     if (!kmsvnc->disable_input) {
         kmsvnc->server->kbdAddEvent = rfb_key_hook;
         kmsvnc->server->ptrAddEvent = rfb_ptr_hook;
@@ -552,24 +785,23 @@ int main(int argc, char **argv)
     int cursor_frame = 0;
     while (rfbIsActive(kmsvnc->server))
     {
+        idle_wait_client();
         between_frames();
+        idle_wait_ready();
         if (kmsvnc->server->clientHead)
         {
-            kmsvnc->drm->funcs->sync_start(kmsvnc->drm->prime_fd);
-            kmsvnc->drm->funcs->convert(kmsvnc->drm->mapped, kmsvnc->drm->mfb->width, kmsvnc->drm->mfb->height, kmsvnc->buf1);
-            kmsvnc->drm->funcs->sync_end(kmsvnc->drm->prime_fd);
-            update_screen_buf(kmsvnc->buf, kmsvnc->buf1, kmsvnc->drm->mfb->width, kmsvnc->drm->mfb->height);
+            capture_frame();
             if (kmsvnc->capture_cursor) {
                 cursor_frame++;
                 cursor_frame %= CURSOR_FRAMESKIP;
-                if (!cursor_frame) {
-                    char *data = NULL;
-                    int width, height;
-                    int err = drm_dump_cursor_plane(&data, &width, &height);
-                    if (!err && data) {
-                        update_vnc_cursor(data, width, height);
-                    }
+                // a new cursor framebuffer is picked up right away, the same one is reread now and then
+                char *data = NULL;
+                int width, height;
+                int err = drm_dump_cursor_plane(&data, &width, &height, !cursor_frame);
+                if (!err && data) {
+                    cursor_update(data, width, height);
                 }
+                cursor_update_pos();
             }
         }
     }
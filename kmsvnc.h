@@ -2,6 +2,7 @@
 
 #include <rfb/rfb.h>
 #include <stdint.h>
+#include <pthread.h>
 #include <xkbcommon/xkbcommon.h>
 
 #include <xf86drm.h>
@@ -14,6 +15,21 @@
 
 #define BYTES_PER_PIXEL 4
 #define CURSOR_FRAMESKIP 15
+#define CURSOR_POINTER_ECHO_NS 500000000
+#define CURSOR_MIN_A 160 // ~63%
+#define CURSOR_CACHE_SIZE 8
+#define DAMAGE_TILE_SIZE 64
+#define DAMAGE_MAX_RECTS 256
+#define DAMAGE_PROBE_ROWS 4
+#define MOTION_MIN_TILES 8
+#define MOTION_MIN_LINES 32
+#define POOL_MAX_AUTO_THREADS 8
+#define DRM_FB_CACHE_SIZE 4
+#define DRM_FAILED_FB_RECHECK 600 // frames
+#define DRM_TILE_MAX_SIZE (128 * 128 * BYTES_PER_PIXEL)
+#define DRM_READ_PROBE_SIZE (4 << 20)
+#define DRM_READ_PROBE_ROUNDS 3
+#define DRM_CALIBRATE_FRAMES 8
 
 struct vnc_opt
 {
@@ -22,6 +38,12 @@ struct vnc_opt
     char *bind6;
     char disable_ipv6;
     int sleep_ns;
+    int vblank_divisor;
+    int fence_timeout_ms;
+    int idle_sleep_ns;
+    int idle_frames;
+    int probe_sweep;
+    char disable_copyrect;
     char always_shared;
     char disable_cmpfb;
     char *desktop_name;
@@ -38,6 +60,14 @@ struct kmsvnc_data
     char disable_input;
     int va_derive_enabled;
     char debug_enabled;
+    char bench;
+    char dither;
+    char cpu_detile;
+    char calibrate;
+    // remembers --calibrate results per driver, modifier and resolution
+    char *calibrate_cache;
+    // of the server framebuffer, 4 or 2 for rgb565
+    int bytes_per_pixel;
     int source_plane;
     int source_crtc;
     int input_width;
@@ -47,17 +77,31 @@ struct kmsvnc_data
     char screen_blank;
     char screen_blank_restore;
     char va_byteorder_swap;
+    char *simd_level;
+    int threads;
     struct kmsvnc_drm_data *drm;
     struct kmsvnc_input_data *input;
     struct kmsvnc_keymap_data *keymap;
     struct kmsvnc_va_data *va;
+    struct kmsvnc_damage_data *damage;
+    struct kmsvnc_simd_funcs *simd;
+    struct kmsvnc_pool_data *pool;
+    struct kmsvnc_idle_data *idle;
+    struct kmsvnc_motion_data *motion;
     rfbScreenInfoPtr server;
     char shutdown;
     char capture_cursor;
-    char *cursor_bitmap;
-    int cursor_bitmap_len;
+    char composite_cursor;
+    struct kmsvnc_cursor_data *cursor;
+    // the client that moved the pointer last does not get its own movement echoed back.
+    // written by the client threads, only ever accessed with __atomic builtins
+    rfbClientPtr pointer_client;
+    int64_t pointer_time_ns;
     char *buf;
     char *buf1;
+    char *buf2;
+    rfbClientPtr *locked_clients;
+    int locked_clients_len;
 };
 
 
@@ -83,11 +127,124 @@ struct kmsvnc_input_data {
 };
 
 
+struct kmsvnc_simd_funcs
+{
+    const char *name;
+    int (*cmp)(const char *, const char *, size_t);
+    int (*cmpcpy)(char *, const char *, size_t);
+    void (*swap_rb)(char *, const char *, size_t);
+    void (*stream)(char *, const char *, size_t);
+    void (*shuffle)(char *, const char *, size_t, const uint8_t *);
+    void (*unpack)(char *, const char *, size_t, const uint8_t *);
+    void (*dither)(char *, const char *, size_t, const uint8_t *, const uint8_t *);
+    void (*pack565)(char *, const char *, size_t, const uint8_t *);
+    int (*alpha_span)(const char *, size_t, uint8_t, int *, int *);
+};
+
+struct kmsvnc_damage_rect
+{
+    int x1;
+    int y1;
+    int x2;
+    int y2;
+};
+
+struct kmsvnc_damage_data
+{
+    int tiles_x;
+    int tiles_y;
+    char *tiles;
+    char *hints;
+    struct kmsvnc_damage_rect *rects;
+    int *active;
+    unsigned int probe_phase;
+    char probe_sweep;
+    int probe_frames;
+};
+
+struct kmsvnc_motion_slot
+{
+    uint64_t hash;
+    int pos;
+};
+
+struct kmsvnc_motion_data
+{
+    uint64_t *hashes;
+    struct kmsvnc_motion_slot *table;
+    unsigned int table_mask;
+    int *votes;
+    char found;
+    int x1, y1, x2, y2;
+    int dx, dy;
+};
+
+
+struct kmsvnc_cursor_shape
+{
+    uint64_t hash;
+    int width;
+    int height;
+    // the cropped bitmap as captured, to rule out hash collisions
+    char *bitmap;
+    // built once, cleanup is off so rfbSetCursor() leaves it to the cache
+    rfbCursorPtr cursor;
+    unsigned int last_used;
+};
+
+struct kmsvnc_cursor_data
+{
+    // the cropped bitmap of the last check and the strings for rfbMakeXCursor(), grown as needed
+    char *bitmap;
+    size_t bitmap_len;
+    char *strings;
+    size_t strings_len;
+    struct kmsvnc_cursor_shape shapes[CURSOR_CACHE_SIZE];
+    int shape_count;
+    unsigned int clock;
+    struct kmsvnc_cursor_shape *current;
+    // rich cursors are cropped to their visible pixels, this is where those start in the cursor plane
+    int offx;
+    int offy;
+};
+
+
+struct kmsvnc_pool_data
+{
+    pthread_t *workers;
+    int worker_count;
+    pthread_mutex_t lock;
+    pthread_cond_t start_cond;
+    pthread_cond_t done_cond;
+    unsigned int generation;
+    int running;
+    char shutdown;
+    void (*job)(int);
+    int jobs;
+    int next_job;
+};
+
+struct kmsvnc_idle_data
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int clients;
+    int unchanged_frames;
+    unsigned int requests;
+};
+
+
 struct kmsvnc_drm_funcs
 {
     void (*sync_start)(int);
     void (*sync_end)(int);
     void (*convert)(const char *, int, int, char *);
+    int (*import)();
+    // convert can be called on any band of rows of a linear buffer
+    char convert_linear;
+    // compares band of diff_rows rows of a tiled buffer in the source domain and converts only changed tiles
+    int (*diff)(const char *, int, int, int, char *);
+    int diff_rows;
 };
 
 struct kmsvnc_drm_gamma_data
@@ -98,6 +255,38 @@ struct kmsvnc_drm_gamma_data
     uint16_t *blue;
 };
 
+struct kmsvnc_drm_fb
+{
+    uint32_t fb_id;
+    drmModeFB2 *mfb;
+    int prime_fd;
+    uint32_t gem_handle;
+    char *mapped;
+    size_t mmap_size;
+    VASurfaceID va_surface_id;
+    VAImage *va_image;
+    char *va_imgbuf;
+    unsigned int last_used;
+};
+
+struct kmsvnc_drm_failed_fb
+{
+    uint32_t fb_id;
+    unsigned int last_used;
+    unsigned int checked;
+};
+
+// tile layouts whose 16 byte spans of pixels are contiguous, but scattered across the tile
+struct kmsvnc_drm_swizzle
+{
+    const char *name;
+    // in pixels
+    int tile_w;
+    int tile_h;
+    // source offset of every 16 byte span of the tile in 16 byte units, row major
+    uint16_t *spans;
+};
+
 struct kmsvnc_drm_data
 {
     int drm_fd;
@@ -108,32 +297,75 @@ struct kmsvnc_drm_data
     drmModePlane *cursor_plane;
     drmModePlaneRes *plane_res;
     drmModeFB2 *mfb;
-    drmModeFB2 *cursor_mfb;
     uint32_t plane_id;
+    int crtc_index;
+    unsigned int vblank_seq;
+    uint32_t gem_handle;
     int mmap_fd;
     size_t mmap_size;
     off_t mmap_offset;
     char *mapped;
-    char *cursor_mapped;
-    size_t cursor_mmap_size;
     char skip_map;
     struct kmsvnc_drm_funcs *funcs;
     char *pixfmt_name;
     char *mod_vendor;
     char *mod_name;
-    char *kms_convert_buf;
-    size_t kms_convert_buf_len;
-    char *kms_cpy_tmp_buf;
-    size_t kms_cpy_tmp_buf_len;
+    // the server framebuffer is laid out like XR24, otherwise like XB24
+    char server_bgrx;
+    // 2:10:10:10 source, converted with simd->unpack
+    char deep;
+    // where the top 8 bits of red, green and blue sit in a 32 bit source pixel
+    uint8_t rgb_shift[4];
+    // of the mapped source, 4 or 2 for rgb565 and xrgb1555
+    int src_bytes_per_pixel;
+    // reads from the mapping when streaming loads beat plain ones, NULL otherwise
+    void (*read)(char *, const char *, size_t);
+    char *shadow;
+    size_t shadow_len;
+    struct kmsvnc_drm_swizzle swizzle;
     char *kms_cursor_buf;
     size_t kms_cursor_buf_len;
+    // mappings of the cursor framebuffers, the one converted into kms_cursor_buf is cursor_fb
+    struct kmsvnc_drm_fb cursor_cache[DRM_FB_CACHE_SIZE];
+    int cursor_cache_count;
+    unsigned int cursor_cache_clock;
+    struct kmsvnc_drm_fb *cursor_fb;
+    uint32_t cursor_failed_fb_id;
+    // the cursor plane's property list as of the last read, and where CRTC_X and CRTC_Y sit in it
+    uint32_t cursor_props_count;
+    uint32_t *cursor_prop_ids;
+    uint64_t *cursor_prop_values;
+    uint32_t cursor_prop_x_id;
+    uint32_t cursor_prop_y_id;
+    int cursor_prop_x;
+    int cursor_prop_y;
     struct kmsvnc_drm_gamma_data *gamma;
+    struct kmsvnc_drm_fb fb_cache[DRM_FB_CACHE_SIZE];
+    int fb_cache_count;
+    unsigned int fb_cache_clock;
+    struct kmsvnc_drm_fb *current_fb;
+    // framebuffers that could not be captured, so flipping to them costs no more than GETPLANE
+    struct kmsvnc_drm_failed_fb failed_fbs[DRM_FB_CACHE_SIZE];
+    int failed_fb_count;
+};
+
+// how to turn one pixel of the vaapi image into the server layout, derived once in va_init()
+struct kmsvnc_va_convert
+{
+    // output byte k is bits shift[k]..shift[k]+7 of the little endian image pixel, 0 if shift[k] > 31
+    uint8_t shift[4];
+    // the same as input byte indices, valid when every shift is a multiple of 8
+    uint8_t idx[4];
+    char bytewise;
+    char identity;
 };
 
 struct kmsvnc_va_data
 {
     VADisplay dpy;
     int render_node_fd;
+    uint32_t rt_format;
+    uint32_t surface_fourcc;
     VASurfaceID surface_id;
     VAImage *image;
     char *imgbuf;
@@ -141,6 +373,7 @@ struct kmsvnc_va_data
     VAImageFormat* img_fmts;
     int img_fmt_count;
     VAImageFormat* selected_fmt;
+    struct kmsvnc_va_convert convert;
     const char *vendor_string;
 };
 
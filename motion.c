@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "motion.h"
+#include "damage.h"
+
+extern struct kmsvnc_data *kmsvnc;
+
+#define MOTION_HASH_PRIME 0x100000001b3ull
+#define MOTION_HASH_EMPTY -1
+#define MOTION_HASH_AMBIGUOUS -2
+
+void motion_cleanup() {
+    if (kmsvnc->motion) {
+        struct kmsvnc_motion_data *motion = kmsvnc->motion;
+        if (motion->hashes) {
+            free(motion->hashes);
+            motion->hashes = NULL;
+        }
+        if (motion->table) {
+            free(motion->table);
+            motion->table = NULL;
+        }
+        if (motion->votes) {
+            free(motion->votes);
+            motion->votes = NULL;
+        }
+        free(kmsvnc->motion);
+        kmsvnc->motion = NULL;
+    }
+}
+
+int motion_init(int width, int height) {
+    struct kmsvnc_motion_data *motion = malloc(sizeof(struct kmsvnc_motion_data));
+    if (!motion) KMSVNC_FATAL("memory allocation error at %s:%d\n", __FILE__, __LINE__);
+    memset(motion, 0, sizeof(struct kmsvnc_motion_data));
+    kmsvnc->motion = motion;
+
+    // row and column hashes of the old and the new frame
+    motion->hashes = malloc(sizeof(uint64_t) * (width + height) * 2);
+    if (!motion->hashes) KMSVNC_FATAL("memory allocation error at %s:%d\n", __FILE__, __LINE__);
+    motion->table_mask = 1;
+    while (motion->table_mask < (width > height ? width : height) * 2) motion->table_mask <<= 1;
+    motion->table = malloc(sizeof(struct kmsvnc_motion_slot) * motion->table_mask);
+    if (!motion->table) KMSVNC_FATAL("memory allocation error at %s:%d\n", __FILE__, __LINE__);
+    motion->table_mask--;
+    motion->votes = malloc(sizeof(int) * (width > height ? width : height) * 2);
+    if (!motion->votes) KMSVNC_FATAL("memory allocation error at %s:%d\n", __FILE__, __LINE__);
+    return 0;
+}
+
+// hashes every row and every column of the box in a single row-major pass
+static void motion_hash(const char *buf, int width, int x1, int y1, int x2, int y2, uint64_t *rows, uint64_t *cols) {
+    const int bpp = kmsvnc->bytes_per_pixel;
+    size_t stride = width * bpp;
+    for (int x = x1; x < x2; x++) cols[x - x1] = 0xcbf29ce484222325ull;
+    for (int y = y1; y < y2; y++) {
+        const char *row = buf + y * stride + x1 * bpp;
+        uint64_t h = 0xcbf29ce484222325ull;
+        for (int i = 0; i < x2 - x1; i++) {
+            uint32_t p = bpp == 2 ? ((const uint16_t *)row)[i] : ((const uint32_t *)row)[i];
+            h = (h ^ p) * MOTION_HASH_PRIME;
+            cols[i] = (cols[i] ^ p) * MOTION_HASH_PRIME;
+        }
+        rows[y - y1] = h;
+    }
+}
+
+static void motion_table_insert(uint64_t hash, int pos) {
+    struct kmsvnc_motion_data *motion = kmsvnc->motion;
+    unsigned int i = (hash ^ (hash >> 29)) & motion->table_mask;
+    while (motion->table[i].pos != MOTION_HASH_EMPTY) {
+        if (motion->table[i].hash == hash) {
+            // blank lines and the like, they cannot tell us where anything moved
+            motion->table[i].pos = MOTION_HASH_AMBIGUOUS;
+            return;
+        }
+        i = (i + 1) & motion->table_mask;
+    }
+    motion->table[i].hash = hash;
+    motion->table[i].pos = pos;
+}
+
+static int motion_table_find(uint64_t hash) {
+    struct kmsvnc_motion_data *motion = kmsvnc->motion;
+    unsigned int i = (hash ^ (hash >> 29)) & motion->table_mask;
+    while (motion->table[i].pos != MOTION_HASH_EMPTY) {
+        if (motion->table[i].hash == hash) return motion->table[i].pos;
+        i = (i + 1) & motion->table_mask;
+    }
+    return MOTION_HASH_EMPTY;
+}
+
+// finds the most voted shift of lines between old and new and the longest run of lines
+// that moved by it, returns the run length
+static int motion_find_shift(const uint64_t *old, const uint64_t *new, int len, int *shift, int *start) {
+    struct kmsvnc_motion_data *motion = kmsvnc->motion;
+    for (unsigned int i = 0; i <= motion->table_mask; i++) motion->table[i].pos = MOTION_HASH_EMPTY;
+    for (int i = 0; i < len; i++) motion_table_insert(old[i], i);
+
+    int *votes = motion->votes + len;
+    memset(motion->votes, 0, sizeof(int) * len * 2);
+    int best = 0;
+    for (int i = 0; i < len; i++) {
+        int pos = motion_table_find(new[i]);
+        if (pos < 0 || pos == i) continue;
+        if (++votes[i - pos] > votes[best]) best = i - pos;
+    }
+    if (!best || votes[best] < MOTION_MIN_LINES) return 0;
+
+    int run = 0;
+    int run_start = 0;
+    int cur = 0;
+    int from = best > 0 ? best : 0;
+    int to = best > 0 ? len : len + best;
+    for (int i = from; i < to; i++) {
+        if (new[i] == old[i - best]) {
+            if (++cur > run) {
+                run = cur;
+                run_start = i - cur + 1;
+            }
+        }
+        else {
+            cur = 0;
+        }
+    }
+    *shift = best;
+    *start = run_start;
+    return run;
+}
+
+static char motion_verify(const char *old, const char *new, int width, int x1, int y1, int x2, int y2, int dx, int dy) {
+    const int bpp = kmsvnc->bytes_per_pixel;
+    size_t stride = width * bpp;
+    for (int y = y1; y < y2; y++) {
+        if (memcmp(new + y * stride + x1 * bpp, old + (y - dy) * stride + (x1 - dx) * bpp, (x2 - x1) * bpp)) return 0;
+    }
+    return 1;
+}
+
+// looks for a scroll or move of a large area inside the damaged tiles between old and new
+// returns 1 with the destination rect and offset in kmsvnc->motion when one is found
+int motion_detect(const char *old, const char *new, int width, int height) {
+    struct kmsvnc_motion_data *motion = kmsvnc->motion;
+    struct kmsvnc_damage_rect box;
+    motion->found = 0;
+
+    if (damage_bounds(&box) < MOTION_MIN_TILES) return 0;
+    int x1 = box.x1 * DAMAGE_TILE_SIZE;
+    int y1 = box.y1 * DAMAGE_TILE_SIZE;
+    int x2 = box.x2 * DAMAGE_TILE_SIZE;
+    int y2 = box.y2 * DAMAGE_TILE_SIZE;
+    if (x2 > width) x2 = width;
+    if (y2 > height) y2 = height;
+    int w = x2 - x1;
+    int h = y2 - y1;
+    if (w < MOTION_MIN_LINES || h < MOTION_MIN_LINES) return 0;
+
+    uint64_t *old_rows = motion->hashes;
+    uint64_t *new_rows = old_rows + height;
+    uint64_t *old_cols = new_rows + height;
+    uint64_t *new_cols = old_cols + width;
+    motion_hash(old, width, x1, y1, x2, y2, old_rows, old_cols);
+    motion_hash(new, width, x1, y1, x2, y2, new_rows, new_cols);
+
+    int dy, ys, dx, xs;
+    int vrun = motion_find_shift(old_rows, new_rows, h, &dy, &ys);
+    int hrun = motion_find_shift(old_cols, new_cols, w, &dx, &xs);
+    if ((long)vrun * w >= (long)hrun * h && vrun) {
+        if (!motion_verify(old, new, width, x1, y1 + ys, x2, y1 + ys + vrun, 0, dy)) return 0;
+        motion->x1 = x1;
+        motion->y1 = y1 + ys;
+        motion->x2 = x2;
+        motion->y2 = y1 + ys + vrun;
+        motion->dx = 0;
+        motion->dy = dy;
+    }
+    else if (hrun) {
+        if (!motion_verify(old, new, width, x1 + xs, y1, x1 + xs + hrun, y2, dx, 0)) return 0;
+        motion->x1 = x1 + xs;
+        motion->y1 = y1;
+        motion->x2 = x1 + xs + hrun;
+        motion->y2 = y2;
+        motion->dx = dx;
+        motion->dy = 0;
+    }
+    else {
+        return 0;
+    }
+    KMSVNC_DEBUG("motion %d,%d for %dx%d at %d,%d\n", motion->dx, motion->dy, motion->x2 - motion->x1, motion->y2 - motion->y1, motion->x1, motion->y1);
+    motion->found = 1;
+    return 1;
+}
+
+// the framebuffer already holds the new frame, clients only need to be told about the copy
+void motion_schedule(rfbScreenInfoPtr server) {
+    struct kmsvnc_motion_data *motion = kmsvnc->motion;
+    if (motion->found) {
+        rfbScheduleCopyRect(server, motion->x1, motion->y1, motion->x2, motion->y2, motion->dx, motion->dy);
+    }
+}
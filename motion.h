@@ -0,0 +1,8 @@
+#pragma once
+
+#include "kmsvnc.h"
+
+void motion_cleanup();
+int motion_init(int width, int height);
+int motion_detect(const char *old, const char *new, int width, int height);
+void motion_schedule(rfbScreenInfoPtr server);
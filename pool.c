@@ -0,0 +1,120 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+extern struct kmsvnc_data *kmsvnc;
+
+// jobs are claimed from a shared counter, threads that finish early keep taking
+// jobs that would otherwise queue behind a slow one
+static void pool_work(struct kmsvnc_pool_data *pool) {
+    int job;
+    while ((job = __atomic_fetch_add(&pool->next_job, 1, __ATOMIC_RELAXED)) < pool->jobs) {
+        pool->job(job);
+    }
+}
+
+static void *pool_worker(void *arg) {
+    struct kmsvnc_pool_data *pool = arg;
+    unsigned int generation = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (!pool->shutdown && pool->generation == generation) {
+            pthread_cond_wait(&pool->start_cond, &pool->lock);
+        }
+        if (pool->shutdown) break;
+        generation = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+        pool_work(pool);
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->running == 0) {
+            pthread_cond_signal(&pool->done_cond);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+void pool_cleanup() {
+    if (kmsvnc->pool) {
+        struct kmsvnc_pool_data *pool = kmsvnc->pool;
+        if (pool->workers) {
+            pthread_mutex_lock(&pool->lock);
+            pool->shutdown = 1;
+            pthread_cond_broadcast(&pool->start_cond);
+            pthread_mutex_unlock(&pool->lock);
+            for (int i = 0; i < pool->worker_count; i++) {
+                pthread_join(pool->workers[i], NULL);
+            }
+            free(pool->workers);
+            pool->workers = NULL;
+        }
+        pthread_cond_destroy(&pool->done_cond);
+        pthread_cond_destroy(&pool->start_cond);
+        pthread_mutex_destroy(&pool->lock);
+        free(kmsvnc->pool);
+        kmsvnc->pool = NULL;
+    }
+}
+
+int pool_init(int threads) {
+    struct kmsvnc_pool_data *pool = malloc(sizeof(struct kmsvnc_pool_data));
+    if (!pool) KMSVNC_FATAL("memory allocation error at %s:%d\n", __FILE__, __LINE__);
+    memset(pool, 0, sizeof(struct kmsvnc_pool_data));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    kmsvnc->pool = pool;
+
+    if (threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (threads > POOL_MAX_AUTO_THREADS) threads = POOL_MAX_AUTO_THREADS;
+        if (threads <= 0) threads = 1;
+    }
+    printf("using %d capture thread%s\n", threads, threads > 1 ? "s" : "");
+    // the thread calling pool_run() works too
+    if (threads <= 1) return 0;
+
+    pool->workers = malloc(sizeof(pthread_t) * (threads - 1));
+    if (!pool->workers) KMSVNC_FATAL("memory allocation error at %s:%d\n", __FILE__, __LINE__);
+    for (int i = 0; i < threads - 1; i++) {
+        if (pthread_create(&pool->workers[i], NULL, pool_worker, pool)) {
+            fprintf(stderr, "failed to create capture thread, continuing with %d\n", i + 1);
+            break;
+        }
+        pool->worker_count++;
+    }
+    return 0;
+}
+
+void pool_run(int jobs, void (*job)(int)) {
+    struct kmsvnc_pool_data *pool = kmsvnc->pool;
+    if (!pool->worker_count) {
+        for (int i = 0; i < jobs; i++) {
+            job(i);
+        }
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->job = job;
+    pool->jobs = jobs;
+    pool->next_job = 0;
+    pool->running = pool->worker_count;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    pool_work(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running) {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include "kmsvnc.h"
+
+void pool_cleanup();
+int pool_init(int threads);
+void pool_run(int jobs, void (*job)(int));
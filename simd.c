@@ -0,0 +1,710 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+    #define KMSVNC_SIMD_X86
+#elif defined(__aarch64__)
+    #include <arm_neon.h>
+    #include <sys/auxv.h>
+    #include <asm/hwcap.h>
+    #define KMSVNC_SIMD_NEON
+#endif
+
+#include "simd.h"
+
+extern struct kmsvnc_data *kmsvnc;
+
+// small enough to stay in L1 while it is copied out again
+#define SIMD_BOUNCE_SIZE 4096
+
+// cmp kernels return non-zero if the two buffers differ
+// cmpcpy kernels also copy the changed parts of src into dst, unchanged parts are not written
+// swap_rb kernels copy 32 bit pixels from src to dst swapping bytes 0 and 2, dst may equal src
+// stream kernels copy from write-combined or uncached device mappings with non-temporal loads
+// shuffle kernels build every output byte k of a 32 bit pixel from input byte idx[k], or 0 if idx[k] > 3
+// unpack kernels build every output byte k from bits shift[k]..shift[k]+7 of the little endian pixel, or 0 if shift[k] > 31
+// pack565 kernels turn 32 bit pixels into rgb565, shift[0..2] locate red, green and blue as for unpack, len counts source bytes
+// alpha_span kernels find the first and last 32 bit pixel whose byte 3 is above min_a, and return 0 if there is none
+
+static int cmp_scalar(const char *a, const char *b, size_t len) {
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        if (*((uint64_t*)(a + i)) != *((uint64_t*)(b + i))) return 1;
+    }
+    for (; i < len; i++) {
+        if (a[i] != b[i]) return 1;
+    }
+    return 0;
+}
+
+static int cmpcpy_scalar(char *dst, const char *src, size_t len) {
+    int changed = 0;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        uint64_t s = *((uint64_t*)(src + i));
+        if (*((uint64_t*)(dst + i)) != s) {
+            *((uint64_t*)(dst + i)) = s;
+            changed = 1;
+        }
+    }
+    for (; i < len; i++) {
+        if (dst[i] != src[i]) {
+            dst[i] = src[i];
+            changed = 1;
+        }
+    }
+    return changed;
+}
+
+static void swap_rb_scalar(char *dst, const char *src, size_t len) {
+    for (size_t i = 0; i + BYTES_PER_PIXEL <= len; i += BYTES_PER_PIXEL) {
+        uint32_t p = *((uint32_t*)(src + i));
+        *((uint32_t*)(dst + i)) = (p & 0xff00ff00u) | ((p >> 16) & 0xffu) | ((p & 0xffu) << 16);
+    }
+}
+
+static void unpack_scalar(char *dst, const char *src, size_t len, const uint8_t *shift) {
+    // a shift past the pixel yields a zero byte, turn it into a zero mask so the loop has no branches
+    const uint32_t s0 = shift[0] & 31, m0 = shift[0] < 32 ? 0xff : 0;
+    const uint32_t s1 = shift[1] & 31, m1 = shift[1] < 32 ? 0xff : 0;
+    const uint32_t s2 = shift[2] & 31, m2 = shift[2] < 32 ? 0xff : 0;
+    const uint32_t s3 = shift[3] & 31, m3 = shift[3] < 32 ? 0xff : 0;
+    for (size_t i = 0; i + BYTES_PER_PIXEL <= len; i += BYTES_PER_PIXEL) {
+        uint32_t p = *((uint32_t*)(src + i));
+        *((uint32_t*)(dst + i)) = (p >> s0 & m0) | (p >> s1 & m1) << 8 | (p >> s2 & m2) << 16 | (p >> s3 & m3) << 24;
+    }
+}
+
+static void shuffle_scalar(char *dst, const char *src, size_t len, const uint8_t *idx) {
+    uint8_t shift[BYTES_PER_PIXEL];
+    for (int k = 0; k < BYTES_PER_PIXEL; k++) {
+        shift[k] = idx[k] < BYTES_PER_PIXEL ? idx[k] * 8 : 32;
+    }
+    unpack_scalar(dst, src, len, shift);
+}
+
+// 10 bit channels, shift[k] is the top 8 bits of channel k as for unpack, the 2 bits below get dithered away
+// bias[0] applies to even pixels of the span and bias[1] to odd ones, byte 3 is zeroed
+static void dither_scalar(char *dst, const char *src, size_t len, const uint8_t *shift, const uint8_t *bias) {
+    const uint32_t s0 = shift[0] - 2, s1 = shift[1] - 2, s2 = shift[2] - 2;
+    for (size_t i = 0, n = 0; i + BYTES_PER_PIXEL <= len; i += BYTES_PER_PIXEL, n++) {
+        uint32_t p = *((uint32_t*)(src + i));
+        uint32_t b = bias[n & 1];
+        uint32_t c0 = (p >> s0 & 0x3ff) + b;
+        uint32_t c1 = (p >> s1 & 0x3ff) + b;
+        uint32_t c2 = (p >> s2 & 0x3ff) + b;
+        if (c0 > 0x3ff) c0 = 0x3ff;
+        if (c1 > 0x3ff) c1 = 0x3ff;
+        if (c2 > 0x3ff) c2 = 0x3ff;
+        *((uint32_t*)(dst + i)) = c0 >> 2 | (c1 >> 2) << 8 | (c2 >> 2) << 16;
+    }
+}
+
+static void pack565_scalar(char *dst, const char *src, size_t len, const uint8_t *shift) {
+    const uint32_t s0 = shift[0], s1 = shift[1], s2 = shift[2];
+    uint16_t *out = (uint16_t*)dst;
+    for (size_t i = 0; i + BYTES_PER_PIXEL <= len; i += BYTES_PER_PIXEL) {
+        uint32_t p = *((uint32_t*)(src + i));
+        *out++ = (p >> s0 & 0xf8) << 8 | (p >> s1 & 0xfc) << 3 | (p >> s2 & 0xff) >> 3;
+    }
+}
+
+static int alpha_span_scalar(const char *src, size_t len, uint8_t min_a, int *first, int *last) {
+    int lo = -1, hi = -1;
+    for (size_t i = 0, n = 0; i + BYTES_PER_PIXEL <= len; i += BYTES_PER_PIXEL, n++) {
+        if ((uint8_t)src[i + 3] > min_a) {
+            if (lo < 0) lo = n;
+            hi = n;
+        }
+    }
+    if (lo < 0) return 0;
+    *first = lo;
+    *last = hi;
+    return 1;
+}
+
+// folds the span of the pixels from n on into first and last
+static inline int alpha_span_tail(const char *src, size_t len, uint8_t min_a, int n, int *first, int *last) {
+    int lo, hi;
+    if (!alpha_span_scalar(src, len, min_a, &lo, &hi)) return *first >= 0;
+    if (*first < 0) *first = n + lo;
+    *last = n + hi;
+    return 1;
+}
+
+#ifdef KMSVNC_SIMD_X86
+__attribute__((target("sse2")))
+static int cmp_sse2(const char *a, const char *b, size_t len) {
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m128i x0 = _mm_xor_si128(_mm_loadu_si128((__m128i*)(a + i)), _mm_loadu_si128((__m128i*)(b + i)));
+        __m128i x1 = _mm_xor_si128(_mm_loadu_si128((__m128i*)(a + i + 16)), _mm_loadu_si128((__m128i*)(b + i + 16)));
+        __m128i x2 = _mm_xor_si128(_mm_loadu_si128((__m128i*)(a + i + 32)), _mm_loadu_si128((__m128i*)(b + i + 32)));
+        __m128i x3 = _mm_xor_si128(_mm_loadu_si128((__m128i*)(a + i + 48)), _mm_loadu_si128((__m128i*)(b + i + 48)));
+        __m128i x = _mm_or_si128(_mm_or_si128(x0, x1), _mm_or_si128(x2, x3));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())) != 0xffff) return 1;
+    }
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_xor_si128(_mm_loadu_si128((__m128i*)(a + i)), _mm_loadu_si128((__m128i*)(b + i)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())) != 0xffff) return 1;
+    }
+    return cmp_scalar(a + i, b + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static int cmp_avx2(const char *a, const char *b, size_t len) {
+    size_t i = 0;
+    for (; i + 128 <= len; i += 128) {
+        __m256i x0 = _mm256_xor_si256(_mm256_loadu_si256((__m256i*)(a + i)), _mm256_loadu_si256((__m256i*)(b + i)));
+        __m256i x1 = _mm256_xor_si256(_mm256_loadu_si256((__m256i*)(a + i + 32)), _mm256_loadu_si256((__m256i*)(b + i + 32)));
+        __m256i x2 = _mm256_xor_si256(_mm256_loadu_si256((__m256i*)(a + i + 64)), _mm256_loadu_si256((__m256i*)(b + i + 64)));
+        __m256i x3 = _mm256_xor_si256(_mm256_loadu_si256((__m256i*)(a + i + 96)), _mm256_loadu_si256((__m256i*)(b + i + 96)));
+        __m256i x = _mm256_or_si256(_mm256_or_si256(x0, x1), _mm256_or_si256(x2, x3));
+        if (!_mm256_testz_si256(x, x)) return 1;
+    }
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_xor_si256(_mm256_loadu_si256((__m256i*)(a + i)), _mm256_loadu_si256((__m256i*)(b + i)));
+        if (!_mm256_testz_si256(x, x)) return 1;
+    }
+    return cmp_sse2(a + i, b + i, len - i);
+}
+
+__attribute__((target("avx512f")))
+static int cmp_avx512(const char *a, const char *b, size_t len) {
+    size_t i = 0;
+    for (; i + 256 <= len; i += 256) {
+        __m512i x0 = _mm512_xor_si512(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+        __m512i x1 = _mm512_xor_si512(_mm512_loadu_si512(a + i + 64), _mm512_loadu_si512(b + i + 64));
+        __m512i x2 = _mm512_xor_si512(_mm512_loadu_si512(a + i + 128), _mm512_loadu_si512(b + i + 128));
+        __m512i x3 = _mm512_xor_si512(_mm512_loadu_si512(a + i + 192), _mm512_loadu_si512(b + i + 192));
+        __m512i x = _mm512_or_si512(_mm512_or_si512(x0, x1), _mm512_or_si512(x2, x3));
+        if (_mm512_test_epi64_mask(x, x)) return 1;
+    }
+    for (; i + 64 <= len; i += 64) {
+        __m512i x = _mm512_xor_si512(_mm512_loadu_si512(a + i), _mm512_loadu_si512(b + i));
+        if (_mm512_test_epi64_mask(x, x)) return 1;
+    }
+    return cmp_avx2(a + i, b + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static int cmpcpy_sse2(char *dst, const char *src, size_t len) {
+    int changed = 0;
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i s = _mm_loadu_si128((__m128i*)(src + i));
+        __m128i d = _mm_loadu_si128((__m128i*)(dst + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(s, d)) != 0xffff) {
+            _mm_storeu_si128((__m128i*)(dst + i), s);
+            changed = 1;
+        }
+    }
+    return cmpcpy_scalar(dst + i, src + i, len - i) | changed;
+}
+
+__attribute__((target("avx2")))
+static int cmpcpy_avx2(char *dst, const char *src, size_t len) {
+    int changed = 0;
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i s = _mm256_loadu_si256((__m256i*)(src + i));
+        __m256i x = _mm256_xor_si256(s, _mm256_loadu_si256((__m256i*)(dst + i)));
+        if (!_mm256_testz_si256(x, x)) {
+            _mm256_storeu_si256((__m256i*)(dst + i), s);
+            changed = 1;
+        }
+    }
+    return cmpcpy_sse2(dst + i, src + i, len - i) | changed;
+}
+
+__attribute__((target("avx512f")))
+static int cmpcpy_avx512(char *dst, const char *src, size_t len) {
+    int changed = 0;
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m512i s = _mm512_loadu_si512(src + i);
+        __m512i x = _mm512_xor_si512(s, _mm512_loadu_si512(dst + i));
+        if (_mm512_test_epi64_mask(x, x)) {
+            _mm512_storeu_si512(dst + i, s);
+            changed = 1;
+        }
+    }
+    return cmpcpy_avx2(dst + i, src + i, len - i) | changed;
+}
+
+__attribute__((target("sse2")))
+static void swap_rb_sse2(char *dst, const char *src, size_t len) {
+    const __m128i keep = _mm_set1_epi32(0xff00ff00);
+    const __m128i low = _mm_set1_epi32(0xff);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i p = _mm_loadu_si128((__m128i*)(src + i));
+        __m128i r = _mm_or_si128(_mm_and_si128(p, keep), _mm_and_si128(_mm_srli_epi32(p, 16), low));
+        r = _mm_or_si128(r, _mm_slli_epi32(_mm_and_si128(p, low), 16));
+        _mm_storeu_si128((__m128i*)(dst + i), r);
+    }
+    swap_rb_scalar(dst + i, src + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void swap_rb_avx2(char *dst, const char *src, size_t len) {
+    const __m256i mask = _mm256_setr_epi8(
+        2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+        2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i p = _mm256_loadu_si256((__m256i*)(src + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_shuffle_epi8(p, mask));
+    }
+    swap_rb_sse2(dst + i, src + i, len - i);
+}
+
+// psrld takes its count from a register, counts past 31 give 0
+__attribute__((target("sse2")))
+static void unpack_sse2(char *dst, const char *src, size_t len, const uint8_t *shift) {
+    const __m128i low = _mm_set1_epi32(0xff);
+    const __m128i c0 = _mm_cvtsi32_si128(shift[0]);
+    const __m128i c1 = _mm_cvtsi32_si128(shift[1]);
+    const __m128i c2 = _mm_cvtsi32_si128(shift[2]);
+    const __m128i c3 = _mm_cvtsi32_si128(shift[3]);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i p = _mm_loadu_si128((__m128i*)(src + i));
+        __m128i r = _mm_and_si128(_mm_srl_epi32(p, c0), low);
+        r = _mm_or_si128(r, _mm_slli_epi32(_mm_and_si128(_mm_srl_epi32(p, c1), low), 8));
+        r = _mm_or_si128(r, _mm_slli_epi32(_mm_and_si128(_mm_srl_epi32(p, c2), low), 16));
+        r = _mm_or_si128(r, _mm_slli_epi32(_mm_srl_epi32(p, c3), 24));
+        _mm_storeu_si128((__m128i*)(dst + i), r);
+    }
+    unpack_scalar(dst + i, src + i, len - i, shift);
+}
+
+// the channels fit in the low 16 bits of each lane, so a signed 16 bit min clamps them
+__attribute__((target("sse2")))
+static void dither_sse2(char *dst, const char *src, size_t len, const uint8_t *shift, const uint8_t *bias) {
+    const __m128i top = _mm_set1_epi32(0x3ff);
+    const __m128i b = _mm_setr_epi32(bias[0], bias[1], bias[0], bias[1]);
+    const __m128i c0 = _mm_cvtsi32_si128(shift[0] - 2);
+    const __m128i c1 = _mm_cvtsi32_si128(shift[1] - 2);
+    const __m128i c2 = _mm_cvtsi32_si128(shift[2] - 2);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i p = _mm_loadu_si128((__m128i*)(src + i));
+        __m128i r = _mm_srli_epi32(_mm_min_epi16(_mm_add_epi32(_mm_and_si128(_mm_srl_epi32(p, c0), top), b), top), 2);
+        __m128i g = _mm_srli_epi32(_mm_min_epi16(_mm_add_epi32(_mm_and_si128(_mm_srl_epi32(p, c1), top), b), top), 2);
+        __m128i u = _mm_srli_epi32(_mm_min_epi16(_mm_add_epi32(_mm_and_si128(_mm_srl_epi32(p, c2), top), b), top), 2);
+        r = _mm_or_si128(r, _mm_or_si128(_mm_slli_epi32(g, 8), _mm_slli_epi32(u, 16)));
+        _mm_storeu_si128((__m128i*)(dst + i), r);
+    }
+    // whole vectors hold an even number of pixels, the tail starts on an even one
+    dither_scalar(dst + i, src + i, len - i, shift, bias);
+}
+
+__attribute__((target("sse2")))
+static inline __m128i pack565_lanes_sse2(__m128i p, __m128i c0, __m128i c1, __m128i c2) {
+    __m128i r = _mm_slli_epi32(_mm_and_si128(_mm_srl_epi32(p, c0), _mm_set1_epi32(0xf8)), 8);
+    __m128i g = _mm_slli_epi32(_mm_and_si128(_mm_srl_epi32(p, c1), _mm_set1_epi32(0xfc)), 3);
+    __m128i b = _mm_srli_epi32(_mm_and_si128(_mm_srl_epi32(p, c2), _mm_set1_epi32(0xf8)), 3);
+    // sign extend the low half so the signed saturating pack keeps all 16 bits
+    return _mm_srai_epi32(_mm_slli_epi32(_mm_or_si128(r, _mm_or_si128(g, b)), 16), 16);
+}
+
+__attribute__((target("sse2")))
+static void pack565_sse2(char *dst, const char *src, size_t len, const uint8_t *shift) {
+    const __m128i c0 = _mm_cvtsi32_si128(shift[0]);
+    const __m128i c1 = _mm_cvtsi32_si128(shift[1]);
+    const __m128i c2 = _mm_cvtsi32_si128(shift[2]);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m128i lo = pack565_lanes_sse2(_mm_loadu_si128((__m128i*)(src + i)), c0, c1, c2);
+        __m128i hi = pack565_lanes_sse2(_mm_loadu_si128((__m128i*)(src + i + 16)), c0, c1, c2);
+        _mm_storeu_si128((__m128i*)(dst + i / 2), _mm_packs_epi32(lo, hi));
+    }
+    pack565_scalar(dst + i / 2, src + i, len - i, shift);
+}
+
+__attribute__((target("avx2")))
+static void unpack_avx2(char *dst, const char *src, size_t len, const uint8_t *shift) {
+    const __m256i low = _mm256_set1_epi32(0xff);
+    const __m128i c0 = _mm_cvtsi32_si128(shift[0]);
+    const __m128i c1 = _mm_cvtsi32_si128(shift[1]);
+    const __m128i c2 = _mm_cvtsi32_si128(shift[2]);
+    const __m128i c3 = _mm_cvtsi32_si128(shift[3]);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i p = _mm256_loadu_si256((__m256i*)(src + i));
+        __m256i r = _mm256_and_si256(_mm256_srl_epi32(p, c0), low);
+        r = _mm256_or_si256(r, _mm256_slli_epi32(_mm256_and_si256(_mm256_srl_epi32(p, c1), low), 8));
+        r = _mm256_or_si256(r, _mm256_slli_epi32(_mm256_and_si256(_mm256_srl_epi32(p, c2), low), 16));
+        r = _mm256_or_si256(r, _mm256_slli_epi32(_mm256_srl_epi32(p, c3), 24));
+        _mm256_storeu_si256((__m256i*)(dst + i), r);
+    }
+    unpack_sse2(dst + i, src + i, len - i, shift);
+}
+
+__attribute__((target("avx2")))
+static void dither_avx2(char *dst, const char *src, size_t len, const uint8_t *shift, const uint8_t *bias) {
+    const __m256i top = _mm256_set1_epi32(0x3ff);
+    const __m256i b = _mm256_setr_epi32(bias[0], bias[1], bias[0], bias[1], bias[0], bias[1], bias[0], bias[1]);
+    const __m128i c0 = _mm_cvtsi32_si128(shift[0] - 2);
+    const __m128i c1 = _mm_cvtsi32_si128(shift[1] - 2);
+    const __m128i c2 = _mm_cvtsi32_si128(shift[2] - 2);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i p = _mm256_loadu_si256((__m256i*)(src + i));
+        __m256i r = _mm256_srli_epi32(_mm256_min_epu32(_mm256_add_epi32(_mm256_and_si256(_mm256_srl_epi32(p, c0), top), b), top), 2);
+        __m256i g = _mm256_srli_epi32(_mm256_min_epu32(_mm256_add_epi32(_mm256_and_si256(_mm256_srl_epi32(p, c1), top), b), top), 2);
+        __m256i u = _mm256_srli_epi32(_mm256_min_epu32(_mm256_add_epi32(_mm256_and_si256(_mm256_srl_epi32(p, c2), top), b), top), 2);
+        r = _mm256_or_si256(r, _mm256_or_si256(_mm256_slli_epi32(g, 8), _mm256_slli_epi32(u, 16)));
+        _mm256_storeu_si256((__m256i*)(dst + i), r);
+    }
+    dither_sse2(dst + i, src + i, len - i, shift, bias);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i pack565_lanes_avx2(__m256i p, __m128i c0, __m128i c1, __m128i c2) {
+    __m256i r = _mm256_slli_epi32(_mm256_and_si256(_mm256_srl_epi32(p, c0), _mm256_set1_epi32(0xf8)), 8);
+    __m256i g = _mm256_slli_epi32(_mm256_and_si256(_mm256_srl_epi32(p, c1), _mm256_set1_epi32(0xfc)), 3);
+    __m256i b = _mm256_srli_epi32(_mm256_and_si256(_mm256_srl_epi32(p, c2), _mm256_set1_epi32(0xf8)), 3);
+    return _mm256_or_si256(r, _mm256_or_si256(g, b));
+}
+
+__attribute__((target("avx2")))
+static void pack565_avx2(char *dst, const char *src, size_t len, const uint8_t *shift) {
+    const __m128i c0 = _mm_cvtsi32_si128(shift[0]);
+    const __m128i c1 = _mm_cvtsi32_si128(shift[1]);
+    const __m128i c2 = _mm_cvtsi32_si128(shift[2]);
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m256i lo = pack565_lanes_avx2(_mm256_loadu_si256((__m256i*)(src + i)), c0, c1, c2);
+        __m256i hi = pack565_lanes_avx2(_mm256_loadu_si256((__m256i*)(src + i + 32)), c0, c1, c2);
+        // packus works within 128 bit lanes, put the quarters back in order
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, hi), 0xd8);
+        _mm256_storeu_si256((__m256i*)(dst + i / 2), packed);
+    }
+    pack565_sse2(dst + i / 2, src + i, len - i, shift);
+}
+
+__attribute__((target("avx2")))
+static void shuffle_avx2(char *dst, const char *src, size_t len, const uint8_t *idx) {
+    // pshufb zeroes bytes whose index has the top bit set
+    uint8_t table[32];
+    for (int j = 0; j < 32; j++) {
+        uint8_t k = idx[j % BYTES_PER_PIXEL];
+        table[j] = k < BYTES_PER_PIXEL ? (j & 12) + k : 0x80;
+    }
+    const __m256i mask = _mm256_loadu_si256((__m256i*)table);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i p = _mm256_loadu_si256((__m256i*)(src + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_shuffle_epi8(p, mask));
+    }
+    shuffle_scalar(dst + i, src + i, len - i, idx);
+}
+
+// MOVNTDQA only streams from write-combined memory in full lines, both stream kernels batch
+// a few KiB of loads into an L1 bounce buffer before writing anything so the fill buffers
+// are not disturbed
+__attribute__((target("sse4.1")))
+static void stream_sse41(char *dst, const char *src, size_t len) {
+    static __thread __m128i bounce[SIMD_BOUNCE_SIZE / sizeof(__m128i)];
+    size_t head = (sizeof(__m128i) - ((uintptr_t)src & (sizeof(__m128i) - 1))) & (sizeof(__m128i) - 1);
+    if (head > len) head = len;
+    memcpy(dst, src, head);
+    size_t i = head;
+    while (len - i >= 64) {
+        size_t n = len - i < SIMD_BOUNCE_SIZE ? (len - i) & ~(size_t)63 : SIMD_BOUNCE_SIZE;
+        for (size_t j = 0; j < n; j += 64) {
+            __m128i *p = (__m128i*)(src + i + j);
+            __m128i *b = bounce + j / sizeof(__m128i);
+            b[0] = _mm_stream_load_si128(p);
+            b[1] = _mm_stream_load_si128(p + 1);
+            b[2] = _mm_stream_load_si128(p + 2);
+            b[3] = _mm_stream_load_si128(p + 3);
+        }
+        memcpy(dst + i, bounce, n);
+        i += n;
+    }
+    memcpy(dst + i, src + i, len - i);
+}
+__attribute__((target("avx2")))
+static void stream_avx2(char *dst, const char *src, size_t len) {
+    static __thread __m256i bounce[SIMD_BOUNCE_SIZE / sizeof(__m256i)];
+    size_t head = (sizeof(__m256i) - ((uintptr_t)src & (sizeof(__m256i) - 1))) & (sizeof(__m256i) - 1);
+    if (head > len) head = len;
+    memcpy(dst, src, head);
+    size_t i = head;
+    while (len - i >= 128) {
+        size_t n = len - i < SIMD_BOUNCE_SIZE ? (len - i) & ~(size_t)127 : SIMD_BOUNCE_SIZE;
+        for (size_t j = 0; j < n; j += 128) {
+            __m256i *p = (__m256i*)(src + i + j);
+            __m256i *b = bounce + j / sizeof(__m256i);
+            b[0] = _mm256_stream_load_si256(p);
+            b[1] = _mm256_stream_load_si256(p + 1);
+            b[2] = _mm256_stream_load_si256(p + 2);
+            b[3] = _mm256_stream_load_si256(p + 3);
+        }
+        memcpy(dst + i, bounce, n);
+        i += n;
+    }
+    memcpy(dst + i, src + i, len - i);
+}
+__attribute__((target("sse2")))
+static int alpha_span_sse2(const char *src, size_t len, uint8_t min_a, int *first, int *last) {
+    const __m128i t = _mm_set1_epi32(min_a);
+    *first = -1;
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i a = _mm_srli_epi32(_mm_loadu_si128((__m128i*)(src + i)), 24);
+        int m = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(a, t)));
+        if (!m) continue;
+        if (*first < 0) *first = i / BYTES_PER_PIXEL + __builtin_ctz(m);
+        *last = i / BYTES_PER_PIXEL + 31 - __builtin_clz(m);
+    }
+    return alpha_span_tail(src + i, len - i, min_a, i / BYTES_PER_PIXEL, first, last);
+}
+
+__attribute__((target("avx2")))
+static int alpha_span_avx2(const char *src, size_t len, uint8_t min_a, int *first, int *last) {
+    const __m256i t = _mm256_set1_epi32(min_a);
+    *first = -1;
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i a = _mm256_srli_epi32(_mm256_loadu_si256((__m256i*)(src + i)), 24);
+        int m = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(a, t)));
+        if (!m) continue;
+        if (*first < 0) *first = i / BYTES_PER_PIXEL + __builtin_ctz(m);
+        *last = i / BYTES_PER_PIXEL + 31 - __builtin_clz(m);
+    }
+    return alpha_span_tail(src + i, len - i, min_a, i / BYTES_PER_PIXEL, first, last);
+}
+#endif
+
+#ifdef KMSVNC_SIMD_NEON
+static int cmp_neon(const char *a, const char *b, size_t len) {
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        uint8x16_t x0 = veorq_u8(vld1q_u8((const uint8_t*)(a + i)), vld1q_u8((const uint8_t*)(b + i)));
+        uint8x16_t x1 = veorq_u8(vld1q_u8((const uint8_t*)(a + i + 16)), vld1q_u8((const uint8_t*)(b + i + 16)));
+        uint8x16_t x2 = veorq_u8(vld1q_u8((const uint8_t*)(a + i + 32)), vld1q_u8((const uint8_t*)(b + i + 32)));
+        uint8x16_t x3 = veorq_u8(vld1q_u8((const uint8_t*)(a + i + 48)), vld1q_u8((const uint8_t*)(b + i + 48)));
+        uint8x16_t x = vorrq_u8(vorrq_u8(x0, x1), vorrq_u8(x2, x3));
+        if (vmaxvq_u32(vreinterpretq_u32_u8(x))) return 1;
+    }
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t x = veorq_u8(vld1q_u8((const uint8_t*)(a + i)), vld1q_u8((const uint8_t*)(b + i)));
+        if (vmaxvq_u32(vreinterpretq_u32_u8(x))) return 1;
+    }
+    return cmp_scalar(a + i, b + i, len - i);
+}
+
+static int cmpcpy_neon(char *dst, const char *src, size_t len) {
+    int changed = 0;
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t s = vld1q_u8((const uint8_t*)(src + i));
+        uint8x16_t x = veorq_u8(s, vld1q_u8((const uint8_t*)(dst + i)));
+        if (vmaxvq_u32(vreinterpretq_u32_u8(x))) {
+            vst1q_u8((uint8_t*)(dst + i), s);
+            changed = 1;
+        }
+    }
+    return cmpcpy_scalar(dst + i, src + i, len - i) | changed;
+}
+
+static void swap_rb_neon(char *dst, const char *src, size_t len) {
+    static const uint8_t idx[16] = {2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15};
+    const uint8x16_t mask = vld1q_u8(idx);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        vst1q_u8((uint8_t*)(dst + i), vqtbl1q_u8(vld1q_u8((const uint8_t*)(src + i)), mask));
+    }
+    swap_rb_scalar(dst + i, src + i, len - i);
+}
+
+static void shuffle_neon(char *dst, const char *src, size_t len, const uint8_t *idx) {
+    // tbl gives 0 for out of range indices
+    uint8_t table[16];
+    for (int j = 0; j < 16; j++) {
+        uint8_t k = idx[j % BYTES_PER_PIXEL];
+        table[j] = k < BYTES_PER_PIXEL ? (j & 12) + k : 0xff;
+    }
+    const uint8x16_t mask = vld1q_u8(table);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        vst1q_u8((uint8_t*)(dst + i), vqtbl1q_u8(vld1q_u8((const uint8_t*)(src + i)), mask));
+    }
+    shuffle_scalar(dst + i, src + i, len - i, idx);
+}
+
+// ushl by a negative count shifts right, counts of -32 and beyond give 0
+static void unpack_neon(char *dst, const char *src, size_t len, const uint8_t *shift) {
+    const uint32x4_t low = vdupq_n_u32(0xff);
+    const int32x4_t c0 = vdupq_n_s32(-(int)shift[0]);
+    const int32x4_t c1 = vdupq_n_s32(-(int)shift[1]);
+    const int32x4_t c2 = vdupq_n_s32(-(int)shift[2]);
+    const int32x4_t c3 = vdupq_n_s32(-(int)shift[3]);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        uint32x4_t p = vld1q_u32((const uint32_t*)(src + i));
+        uint32x4_t r = vandq_u32(vshlq_u32(p, c0), low);
+        r = vorrq_u32(r, vshlq_n_u32(vandq_u32(vshlq_u32(p, c1), low), 8));
+        r = vorrq_u32(r, vshlq_n_u32(vandq_u32(vshlq_u32(p, c2), low), 16));
+        r = vorrq_u32(r, vshlq_n_u32(vshlq_u32(p, c3), 24));
+        vst1q_u32((uint32_t*)(dst + i), r);
+    }
+    unpack_scalar(dst + i, src + i, len - i, shift);
+}
+
+static void dither_neon(char *dst, const char *src, size_t len, const uint8_t *shift, const uint8_t *bias) {
+    const uint32x4_t top = vdupq_n_u32(0x3ff);
+    const uint32_t pattern[4] = {bias[0], bias[1], bias[0], bias[1]};
+    const uint32x4_t b = vld1q_u32(pattern);
+    const int32x4_t c0 = vdupq_n_s32(2 - (int)shift[0]);
+    const int32x4_t c1 = vdupq_n_s32(2 - (int)shift[1]);
+    const int32x4_t c2 = vdupq_n_s32(2 - (int)shift[2]);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        uint32x4_t p = vld1q_u32((const uint32_t*)(src + i));
+        uint32x4_t r = vshrq_n_u32(vminq_u32(vaddq_u32(vandq_u32(vshlq_u32(p, c0), top), b), top), 2);
+        uint32x4_t g = vshrq_n_u32(vminq_u32(vaddq_u32(vandq_u32(vshlq_u32(p, c1), top), b), top), 2);
+        uint32x4_t u = vshrq_n_u32(vminq_u32(vaddq_u32(vandq_u32(vshlq_u32(p, c2), top), b), top), 2);
+        r = vorrq_u32(r, vorrq_u32(vshlq_n_u32(g, 8), vshlq_n_u32(u, 16)));
+        vst1q_u32((uint32_t*)(dst + i), r);
+    }
+    dither_scalar(dst + i, src + i, len - i, shift, bias);
+}
+
+static inline uint16x4_t pack565_lanes_neon(uint32x4_t p, int32x4_t c0, int32x4_t c1, int32x4_t c2) {
+    uint32x4_t r = vshlq_n_u32(vandq_u32(vshlq_u32(p, c0), vdupq_n_u32(0xf8)), 8);
+    uint32x4_t g = vshlq_n_u32(vandq_u32(vshlq_u32(p, c1), vdupq_n_u32(0xfc)), 3);
+    uint32x4_t b = vshrq_n_u32(vandq_u32(vshlq_u32(p, c2), vdupq_n_u32(0xf8)), 3);
+    return vmovn_u32(vorrq_u32(r, vorrq_u32(g, b)));
+}
+
+static void pack565_neon(char *dst, const char *src, size_t len, const uint8_t *shift) {
+    const int32x4_t c0 = vdupq_n_s32(-(int)shift[0]);
+    const int32x4_t c1 = vdupq_n_s32(-(int)shift[1]);
+    const int32x4_t c2 = vdupq_n_s32(-(int)shift[2]);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        uint16x4_t lo = pack565_lanes_neon(vld1q_u32((const uint32_t*)(src + i)), c0, c1, c2);
+        uint16x4_t hi = pack565_lanes_neon(vld1q_u32((const uint32_t*)(src + i + 16)), c0, c1, c2);
+        vst1q_u16((uint16_t*)(dst + i / 2), vcombine_u16(lo, hi));
+    }
+    pack565_scalar(dst + i / 2, src + i, len - i, shift);
+}
+
+// LDNP is only a hint, but keeps the source from evicting useful lines
+static void stream_neon(char *dst, const char *src, size_t len) {
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __asm__ volatile(
+            "ldnp q0, q1, [%1]\n"
+            "ldnp q2, q3, [%1, #32]\n"
+            "stp q0, q1, [%0]\n"
+            "stp q2, q3, [%0, #32]\n"
+            : : "r"(dst + i), "r"(src + i) : "v0", "v1", "v2", "v3", "memory");
+    }
+    memcpy(dst + i, src + i, len - i);
+}
+
+static int alpha_span_neon(const char *src, size_t len, uint8_t min_a, int *first, int *last) {
+    static const uint32_t bits[4] = {1, 2, 4, 8};
+    const uint32x4_t t = vdupq_n_u32(min_a);
+    const uint32x4_t b = vld1q_u32(bits);
+    *first = -1;
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        uint32x4_t a = vshrq_n_u32(vld1q_u32((const uint32_t*)(src + i)), 24);
+        int m = vaddvq_u32(vandq_u32(vcgtq_u32(a, t), b));
+        if (!m) continue;
+        if (*first < 0) *first = i / BYTES_PER_PIXEL + __builtin_ctz(m);
+        *last = i / BYTES_PER_PIXEL + 31 - __builtin_clz(m);
+    }
+    return alpha_span_tail(src + i, len - i, min_a, i / BYTES_PER_PIXEL, first, last);
+}
+#endif
+
+static int simd_supported_scalar() {
+    return 1;
+}
+#ifdef KMSVNC_SIMD_X86
+static int simd_supported_sse2() {
+    return __builtin_cpu_supports("sse2");
+}
+static int simd_supported_sse41() {
+    return __builtin_cpu_supports("sse4.1");
+}
+static int simd_supported_avx2() {
+    return __builtin_cpu_supports("avx2");
+}
+static int simd_supported_avx512() {
+    return __builtin_cpu_supports("avx512f");
+}
+#endif
+#ifdef KMSVNC_SIMD_NEON
+static int simd_supported_neon() {
+    return !!(getauxval(AT_HWCAP) & HWCAP_ASIMD);
+}
+#endif
+
+// in order of preference
+static const struct {
+    int (*supported)();
+    struct kmsvnc_simd_funcs funcs;
+} simd_impls[] = {
+#ifdef KMSVNC_SIMD_X86
+    // byte shuffles on 512 bit vectors need avx512bw, and wider vectors do not speed up copy bound kernels
+    {simd_supported_avx512, {"avx512", cmp_avx512, cmpcpy_avx512, swap_rb_avx2, stream_avx2, shuffle_avx2, unpack_avx2, dither_avx2, pack565_avx2, alpha_span_avx2}},
+    {simd_supported_avx2, {"avx2", cmp_avx2, cmpcpy_avx2, swap_rb_avx2, stream_avx2, shuffle_avx2, unpack_avx2, dither_avx2, pack565_avx2, alpha_span_avx2}},
+    // the sse kernels have no byte shuffle, unpack handles byte shuffles too
+    {simd_supported_sse41, {"sse4.1", cmp_sse2, cmpcpy_sse2, swap_rb_sse2, stream_sse41, NULL, unpack_sse2, dither_sse2, pack565_sse2, alpha_span_sse2}},
+    // no streaming loads before sse4.1
+    {simd_supported_sse2, {"sse2", cmp_sse2, cmpcpy_sse2, swap_rb_sse2, NULL, NULL, unpack_sse2, dither_sse2, pack565_sse2, alpha_span_sse2}},
+#endif
+#ifdef KMSVNC_SIMD_NEON
+    {simd_supported_neon, {"neon", cmp_neon, cmpcpy_neon, swap_rb_neon, stream_neon, shuffle_neon, unpack_neon, dither_neon, pack565_neon, alpha_span_neon}},
+#endif
+    {simd_supported_scalar, {"scalar", cmp_scalar, cmpcpy_scalar, swap_rb_scalar, NULL, shuffle_scalar, unpack_scalar, dither_scalar, pack565_scalar, alpha_span_scalar}},
+};
+
+void simd_cleanup() {
+    if (kmsvnc->simd) {
+        free(kmsvnc->simd);
+        kmsvnc->simd = NULL;
+    }
+}
+
+int simd_init() {
+    struct kmsvnc_simd_funcs *simd = malloc(sizeof(struct kmsvnc_simd_funcs));
+    if (!simd) KMSVNC_FATAL("memory allocation error at %s:%d\n", __FILE__, __LINE__);
+    memset(simd, 0, sizeof(struct kmsvnc_simd_funcs));
+    kmsvnc->simd = simd;
+
+#ifdef KMSVNC_SIMD_X86
+    __builtin_cpu_init();
+#endif
+    for (int i = 0; i < KMSVNC_ARRAY_ELEMENTS(simd_impls); i++) {
+        if (kmsvnc->simd_level && strcmp(kmsvnc->simd_level, "auto") && strcmp(kmsvnc->simd_level, simd_impls[i].funcs.name)) {
+            continue;
+        }
+        if (!simd_impls[i].supported()) {
+            if (kmsvnc->simd_level && strcmp(kmsvnc->simd_level, "auto")) {
+                KMSVNC_FATAL("simd level %s is not supported by this cpu\n", kmsvnc->simd_level);
+            }
+            continue;
+        }
+        memcpy(simd, &simd_impls[i].funcs, sizeof(struct kmsvnc_simd_funcs));
+        break;
+    }
+    if (!simd->name) {
+        KMSVNC_FATAL("unknown simd level %s\n", kmsvnc->simd_level);
+    }
+    printf("using %s simd kernels\n", simd->name);
+    return 0;
+}
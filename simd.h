@@ -0,0 +1,6 @@
+#pragma once
+
+#include "kmsvnc.h"
+
+void simd_cleanup();
+int simd_init();
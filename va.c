@@ -14,27 +14,18 @@
 extern struct kmsvnc_data *kmsvnc;
 
 void va_cleanup() {
-    VAStatus s;
     if (kmsvnc->va) {
         if (kmsvnc->va->img_fmts) {
             free(kmsvnc->va->img_fmts);
             kmsvnc->va->img_fmts = NULL;
         }
-        if (kmsvnc->va->imgbuf) {
-            VA_MAY(vaUnmapBuffer(kmsvnc->va->dpy, kmsvnc->va->image->buf));
-            kmsvnc->va->imgbuf = NULL;
-        }
-        if (kmsvnc->va->image) {
-            if ((s = vaDestroyImage(kmsvnc->va->dpy, kmsvnc->va->image->image_id)) == VA_STATUS_SUCCESS) {
-                free(kmsvnc->va->image);
-            }
-            VA_MAY(s);
-            kmsvnc->va->image = NULL;
-        }
-        if (kmsvnc->va->surface_id > 0) {
-            VA_MAY(vaDestroySurfaces(kmsvnc->va->dpy, &kmsvnc->va->surface_id, 1));
-            kmsvnc->va->surface_id = 0;
+        // surfaces and derived images belong to the drm framebuffer cache
+        if (!kmsvnc->va->derive_enabled) {
+            va_release_surface(0, kmsvnc->va->image, kmsvnc->va->imgbuf);
         }
+        kmsvnc->va->imgbuf = NULL;
+        kmsvnc->va->image = NULL;
+        kmsvnc->va->surface_id = 0;
         if (kmsvnc->va->dpy) {
             VA_MAY(vaTerminate(kmsvnc->va->dpy));
             kmsvnc->va->dpy = NULL;
@@ -47,6 +38,22 @@ void va_cleanup() {
     }
 }
 
+void va_release_surface(VASurfaceID surface_id, VAImage *image, char *imgbuf) {
+    VAStatus s;
+    if (imgbuf) {
+        VA_MAY(vaUnmapBuffer(kmsvnc->va->dpy, image->buf));
+    }
+    if (image) {
+        if ((s = vaDestroyImage(kmsvnc->va->dpy, image->image_id)) == VA_STATUS_SUCCESS) {
+            free(image);
+        }
+        VA_MAY(s);
+    }
+    if (surface_id > 0) {
+        VA_MAY(vaDestroySurfaces(kmsvnc->va->dpy, &surface_id, 1));
+    }
+}
+
 static void va_msg_callback(void *user_context, const char *message) {
     if (kmsvnc->debug_enabled) {
         printf("va msg: %s", message);
@@ -78,13 +85,26 @@ static const struct {
     {KMSVNC_FOURCC_TO_INT('A', 'R', '3', '0'), KMSVNC_FOURCC_TO_INT('A', 'R', '3', '0'), VA_RT_FORMAT_RGB32_10, 1},
 };
 
-struct va_fmt_data {
-    uint32_t va_fourcc;
-    VAImageFormat *fmt;
-    char is_alpha;
-    uint32_t va_rt_format;
-    uint32_t depth;
+const struct va_fmt_data va_formats_to_try[] = {
+    {KMSVNC_FOURCC_TO_INT('R','G','B','X'), NULL, 0, VA_RT_FORMAT_RGB32, 24},
+    {KMSVNC_FOURCC_TO_INT('R','G','B','A'), NULL, 1, VA_RT_FORMAT_RGB32, 32},
+
+    {KMSVNC_FOURCC_TO_INT('X','B','G','R'), NULL, 0, VA_RT_FORMAT_RGB32, 24},
+    {KMSVNC_FOURCC_TO_INT('A','B','G','R'), NULL, 1, VA_RT_FORMAT_RGB32, 32},
+
+    {KMSVNC_FOURCC_TO_INT('X','R','G','B'), NULL, 0, VA_RT_FORMAT_RGB32, 24},
+    {KMSVNC_FOURCC_TO_INT('A','R','G','B'), NULL, 1, VA_RT_FORMAT_RGB32, 32},
+
+    {KMSVNC_FOURCC_TO_INT('B','G','R','X'), NULL, 0, VA_RT_FORMAT_RGB32, 24},
+    {KMSVNC_FOURCC_TO_INT('B','G','R','A'), NULL, 1, VA_RT_FORMAT_RGB32, 32},
+
+
+    {KMSVNC_FOURCC_TO_INT('X','R','3','0'), NULL, 0, VA_RT_FORMAT_RGB32_10, 30},
+    {KMSVNC_FOURCC_TO_INT('A','R','3','0'), NULL, 1, VA_RT_FORMAT_RGB32_10, 30},
+    {KMSVNC_FOURCC_TO_INT('X','B','3','0'), NULL, 0, VA_RT_FORMAT_RGB32_10, 30},
+    {KMSVNC_FOURCC_TO_INT('A','B','3','0'), NULL, 1, VA_RT_FORMAT_RGB32_10, 30},
 };
+const int va_formats_to_try_len = KMSVNC_ARRAY_ELEMENTS(va_formats_to_try);
 
 static VAImageFormat* vaImgFmt_apply_quirks(struct va_fmt_data* data) {
     static VAImageFormat ret = {0};
@@ -115,50 +135,9 @@ static void print_va_image_fmt(VAImageFormat *fmt) {
     );
 }
 
-int va_init() {
-    if (!kmsvnc->drm || !kmsvnc->drm->drm_fd || !kmsvnc->drm->prime_fd) {
-        KMSVNC_FATAL("drm is not initialized\n");
-    }
-
-    setenv("DISPLAY", "", 1);
-    setenv("WAYLAND_DISPLAY", "", 1);
-
-    struct kmsvnc_va_data *va = malloc(sizeof(struct kmsvnc_va_data));
-    if (!va) KMSVNC_FATAL("memory allocation error at %s:%d\n", __FILE__, __LINE__);
-    memset(va, 0, sizeof(struct kmsvnc_va_data));
-    kmsvnc->va = va;
-
-    char* render_node;
-    int effective_fd = 0;
-    if ((render_node = drmGetRenderDeviceNameFromFd(kmsvnc->drm->drm_fd))) {
-        va->render_node_fd = open(render_node, O_RDWR);
-        free(render_node);
-    }
-    else {
-        printf("Using non-render node because the device does not have an associated render node.\n");
-    }
-    if (va->render_node_fd > 0) {
-        effective_fd = va->render_node_fd;
-    }
-    else {
-        printf("Using non-render node because render node fails to open.\n");
-        effective_fd = kmsvnc->drm->drm_fd;
-    }
-
-    va->dpy = vaGetDisplayDRM(effective_fd);
-    if (!va->dpy) {
-        KMSVNC_FATAL("vaGetDisplayDRM failed\n");
-    }
-
-    vaSetErrorCallback(va->dpy, &va_error_callback, NULL);
-    vaSetInfoCallback(va->dpy, &va_msg_callback, NULL);
-
-    int major, minor;
-    VAStatus status;
-    VA_MUST(vaInitialize(va->dpy, &major, &minor));
-
-    va->vendor_string = vaQueryVendorString(va->dpy);
-    printf("vaapi vendor %s\n", va->vendor_string);
+// import the current framebuffer (drm->mfb, drm->prime_fd) as a surface
+static int va_create_surface(VASurfaceID *surface_id) {
+    struct kmsvnc_va_data *va = kmsvnc->va;
 
     VADRMPRIMESurfaceDescriptor prime_desc;
     VASurfaceAttrib prime_attrs[2] = {
@@ -176,22 +155,7 @@ int va_init() {
         }
     };
 
-    uint32_t rt_format = 0;
-    char is_alpha = 0;
-    for (int i = 0; i < KMSVNC_ARRAY_ELEMENTS(va_format_map); i++) {
-        if (kmsvnc->drm->mfb->pixel_format == va_format_map[i].drm_fourcc) {
-            prime_desc.fourcc = va_format_map[i].va_fourcc;
-            rt_format = va_format_map[i].va_rt_format;
-            is_alpha = va_format_map[i].alpha;
-            break;
-        }
-    }
-    if (!rt_format) {
-        KMSVNC_FATAL("Unsupported pixfmt %s for vaapi, please create an issue with your pixfmt.", kmsvnc->drm->pixfmt_name);
-    }
-    if (kmsvnc->debug_enabled) {
-        printf("selected rt_format %u, alpha %d\n", rt_format, is_alpha);
-    }
+    prime_desc.fourcc = va->surface_fourcc;
     prime_desc.width = kmsvnc->drm->mfb->width;
     prime_desc.height = kmsvnc->drm->mfb->height;
 
@@ -223,8 +187,8 @@ int va_init() {
     prime_desc.num_objects = 1;
 
     VAStatus s;
-    if ((s = vaCreateSurfaces(va->dpy, rt_format,
-                            kmsvnc->drm->mfb->width, kmsvnc->drm->mfb->height, &va->surface_id, 1,
+    if ((s = vaCreateSurfaces(va->dpy, va->rt_format,
+                            kmsvnc->drm->mfb->width, kmsvnc->drm->mfb->height, surface_id, 1,
                             prime_attrs, KMSVNC_ARRAY_ELEMENTS(prime_attrs))) != VA_STATUS_SUCCESS)
     {
         printf("vaCreateSurfaces prime2 error %#x %s, trying prime\n", s, vaErrorStr(s));
@@ -262,12 +226,79 @@ int va_init() {
         buffer_desc.num_planes = prime_desc.layers[0].num_planes;
 
 
-        VA_MUST(vaCreateSurfaces(va->dpy, rt_format,
-                kmsvnc->drm->mfb->width, kmsvnc->drm->mfb->height, &va->surface_id, 1,
+        VA_MUST(vaCreateSurfaces(va->dpy, va->rt_format,
+                kmsvnc->drm->mfb->width, kmsvnc->drm->mfb->height, surface_id, 1,
                 buffer_attrs, KMSVNC_ARRAY_ELEMENTS(buffer_attrs)));
     }
+    return 0;
+}
+
+int va_init() {
+    if (!kmsvnc->drm || !kmsvnc->drm->drm_fd || !kmsvnc->drm->prime_fd) {
+        KMSVNC_FATAL("drm is not initialized\n");
+    }
+
+    setenv("DISPLAY", "", 1);
+    setenv("WAYLAND_DISPLAY", "", 1);
+
+    struct kmsvnc_va_data *va = malloc(sizeof(struct kmsvnc_va_data));
+    if (!va) KMSVNC_FATAL("memory allocation error at %s:%d\n", __FILE__, __LINE__);
+    memset(va, 0, sizeof(struct kmsvnc_va_data));
+    kmsvnc->va = va;
+
+    char* render_node;
+    int effective_fd = 0;
+    if ((render_node = drmGetRenderDeviceNameFromFd(kmsvnc->drm->drm_fd))) {
+        va->render_node_fd = open(render_node, O_RDWR);
+        free(render_node);
+    }
+    else {
+        printf("Using non-render node because the device does not have an associated render node.\n");
+    }
+    if (va->render_node_fd > 0) {
+        effective_fd = va->render_node_fd;
+    }
+    else {
+        printf("Using non-render node because render node fails to open.\n");
+        effective_fd = kmsvnc->drm->drm_fd;
+    }
+
+    va->dpy = vaGetDisplayDRM(effective_fd);
+    if (!va->dpy) {
+        KMSVNC_FATAL("vaGetDisplayDRM failed\n");
+    }
+
+    vaSetErrorCallback(va->dpy, &va_error_callback, NULL);
+    vaSetInfoCallback(va->dpy, &va_msg_callback, NULL);
+
+    int major, minor;
+    VAStatus status;
+    VA_MUST(vaInitialize(va->dpy, &major, &minor));
+
+    va->vendor_string = vaQueryVendorString(va->dpy);
+    printf("vaapi vendor %s\n", va->vendor_string);
+
+    uint32_t rt_format = 0;
+    char is_alpha = 0;
+    for (int i = 0; i < KMSVNC_ARRAY_ELEMENTS(va_format_map); i++) {
+        if (kmsvnc->drm->mfb->pixel_format == va_format_map[i].drm_fourcc) {
+            va->surface_fourcc = va_format_map[i].va_fourcc;
+            rt_format = va_format_map[i].va_rt_format;
+            is_alpha = va_format_map[i].alpha;
+            break;
+        }
+    }
+    if (!rt_format) {
+        KMSVNC_FATAL("Unsupported pixfmt %s for vaapi, please create an issue with your pixfmt.", kmsvnc->drm->pixfmt_name);
+    }
+    if (kmsvnc->debug_enabled) {
+        printf("selected rt_format %u, alpha %d\n", rt_format, is_alpha);
+    }
+    va->rt_format = rt_format;
 
+    if (va_create_surface(&va->surface_id)) return 1;
 
+    VAStatus s;
     va->img_fmt_count = vaMaxNumImageFormats(va->dpy);
     va->img_fmts = malloc(sizeof(VAImageFormat) * va->img_fmt_count);
     if (!va->img_fmts) KMSVNC_FATAL("memory allocation error at %s:%d\n", __FILE__, __LINE__);
@@ -286,25 +317,8 @@ int va_init() {
         }
     }
 
-    struct va_fmt_data format_to_try[] = {
-        {KMSVNC_FOURCC_TO_INT('R','G','B','X'), NULL, 0, VA_RT_FORMAT_RGB32, 24},
-        {KMSVNC_FOURCC_TO_INT('R','G','B','A'), NULL, 1, VA_RT_FORMAT_RGB32, 32},
-
-        {KMSVNC_FOURCC_TO_INT('X','B','G','R'), NULL, 0, VA_RT_FORMAT_RGB32, 24},
-        {KMSVNC_FOURCC_TO_INT('A','B','G','R'), NULL, 1, VA_RT_FORMAT_RGB32, 32},
-
-        {KMSVNC_FOURCC_TO_INT('X','R','G','B'), NULL, 0, VA_RT_FORMAT_RGB32, 24},
-        {KMSVNC_FOURCC_TO_INT('A','R','G','B'), NULL, 1, VA_RT_FORMAT_RGB32, 32},
-
-        {KMSVNC_FOURCC_TO_INT('B','G','R','X'), NULL, 0, VA_RT_FORMAT_RGB32, 24},
-        {KMSVNC_FOURCC_TO_INT('B','G','R','A'), NULL, 1, VA_RT_FORMAT_RGB32, 32},
-
-
-        {KMSVNC_FOURCC_TO_INT('X','R','3','0'), NULL, 0, VA_RT_FORMAT_RGB32_10, 30},
-        {KMSVNC_FOURCC_TO_INT('A','R','3','0'), NULL, 1, VA_RT_FORMAT_RGB32_10, 30},
-        {KMSVNC_FOURCC_TO_INT('X','B','3','0'), NULL, 0, VA_RT_FORMAT_RGB32_10, 30},
-        {KMSVNC_FOURCC_TO_INT('A','B','3','0'), NULL, 1, VA_RT_FORMAT_RGB32_10, 30},
-    };
+    struct va_fmt_data format_to_try[KMSVNC_ARRAY_ELEMENTS(va_formats_to_try)];
+    memcpy(format_to_try, va_formats_to_try, sizeof(format_to_try));
 
     for (int i = 0; i < va->img_fmt_count; i++) {
         for (int j = 0; j < KMSVNC_ARRAY_ELEMENTS(format_to_try); j++) {
@@ -384,6 +398,116 @@ int va_init() {
         fprintf(stderr, "selected image format:\n");
         print_va_image_fmt(va->selected_fmt);
     }
+    va_plan_convert(va->selected_fmt, &va->convert);
+    KMSVNC_DEBUG("image conversion: shifts %d %d %d %d%s\n", va->convert.shift[0], va->convert.shift[1], va->convert.shift[2], va->convert.shift[3],
+        va->convert.identity ? ", plain copy" : va->convert.bytewise ? ", byte shuffle" : "");
+    return 0;
+}
+
+// folds the byte order swap, xrgb shift and bgrx swizzle that used to be separate passes
+// into one shift per output byte
+void va_plan_convert(const VAImageFormat *fmt, struct kmsvnc_va_convert *plan) {
+    uint8_t shift[4] = {0, 8, 16, 24};
+    if ((KMSVNC_FOURCC_TO_INT('R','G','B',0) & fmt->fourcc) != KMSVNC_FOURCC_TO_INT('R','G','B',0)) {
+        if (fmt->depth == 30) {
+            // top 8 bits of each 10 bit channel, byte 3 is kept as is
+            shift[0] = 22;
+            shift[1] = 12;
+            shift[2] = 2;
+        }
+        else if (!fmt->byte_order) {
+            for (int k = 0; k < 4; k++) shift[k] = 24 - 8 * k;
+        }
+        // is xrgb?
+        if ((fmt->blue_mask | fmt->red_mask) < 0x1000000) {
+            shift[0] = shift[1];
+            shift[1] = shift[2];
+            shift[2] = shift[3];
+            shift[3] = 32;
+        }
+        // is bgrx?
+        if (fmt->blue_mask > fmt->red_mask) {
+            uint8_t tmp = shift[0];
+            shift[0] = shift[2];
+            shift[2] = tmp;
+        }
+    }
+    plan->bytewise = 1;
+    plan->identity = 1;
+    for (int k = 0; k < 4; k++) {
+        plan->shift[k] = shift[k];
+        plan->idx[k] = shift[k] < 32 ? shift[k] / 8 : 0xff;
+        if (shift[k] < 32 && shift[k] % 8) plan->bytewise = 0;
+        if (shift[k] != 8 * k) plan->identity = 0;
+    }
+}
+
+// converts a whole image in one pass, pitch is the distance between rows of in
+void va_convert_image(const struct kmsvnc_va_convert *plan, char *out, const char *in, int width, int height, int pitch) {
+    size_t len = (size_t)width * BYTES_PER_PIXEL;
+    if (pitch == len) {
+        len *= height;
+        height = 1;
+    }
+    for (int y = 0; y < height; y++) {
+        char *dst = out + y * len;
+        const char *src = in + (size_t)y * pitch;
+        if (plan->identity) {
+            memcpy(dst, src, len);
+        }
+        else if (plan->bytewise && kmsvnc->simd->shuffle) {
+            kmsvnc->simd->shuffle(dst, src, len, plan->idx);
+        }
+        else {
+            kmsvnc->simd->unpack(dst, src, len, plan->shift);
+        }
+    }
+}
+
+// import another framebuffer with the same layout after va_init(), the result replaces
+// va->surface_id (and va->image, va->imgbuf when deriving) without releasing the old ones
+int va_import_surface() {
+    struct kmsvnc_va_data *va = kmsvnc->va;
+    VASurfaceID surface_id;
+    VAStatus s;
+
+    if (va_create_surface(&surface_id)) return 1;
+    if (va->derive_enabled) {
+        VAImage *image = malloc(sizeof(VAImage));
+        char *imgbuf = NULL;
+        if (!image) {
+            va_release_surface(surface_id, NULL, NULL);
+            KMSVNC_FATAL("memory allocation error at %s:%d\n", __FILE__, __LINE__);
+        }
+        if ((s = vaDeriveImage(va->dpy, surface_id, image)) != VA_STATUS_SUCCESS) {
+            free(image);
+            va_release_surface(surface_id, NULL, NULL);
+            KMSVNC_FATAL("vaDeriveImage error %#x %s\n", s, vaErrorStr(s));
+        }
+        if (image->format.fourcc != va->image->format.fourcc) {
+            va_release_surface(surface_id, image, NULL);
+            KMSVNC_FATAL("vaDeriveImage returned fourcc %s, expected the same as the first framebuffer\n", fourcc_to_str(image->format.fourcc));
+        }
+        if ((s = vaMapBuffer(va->dpy, image->buf, (void**)&imgbuf)) != VA_STATUS_SUCCESS) {
+            va_release_surface(surface_id, image, NULL);
+            KMSVNC_FATAL("vaMapBuffer error %#x %s\n", s, vaErrorStr(s));
+        }
+        va->image = image;
+        va->imgbuf = imgbuf;
+    }
+    va->surface_id = surface_id;
+    return 0;
+}
+
+// reads the image straight into the server layout
+int va_convert(char *out) {
+    struct kmsvnc_va_data *va = kmsvnc->va;
+    if (!va->derive_enabled) {
+        VA_MUST(vaGetImage(va->dpy, va->surface_id, 0, 0,
+                kmsvnc->drm->mfb->width, kmsvnc->drm->mfb->height, va->image->image_id));
+    }
+    va_convert_image(&va->convert, out, va->imgbuf + va->image->offsets[0],
+        kmsvnc->drm->mfb->width, kmsvnc->drm->mfb->height, va->image->pitches[0]);
     return 0;
 }
 
@@ -3,6 +3,24 @@
 #define VA_MUST(x) do{VAStatus _s; if ((_s = (x)) != VA_STATUS_SUCCESS) KMSVNC_FATAL("va operation error %#x %s on line %d\n", _s, vaErrorStr(_s), __LINE__); } while (0)
 #define VA_MAY(x) do{VAStatus _s; if ((_s = (x)) != VA_STATUS_SUCCESS) fprintf(stderr, "va operation error %#x %s on line %d\n", _s, vaErrorStr(_s), __LINE__); } while (0)
 
+struct va_fmt_data {
+    uint32_t va_fourcc;
+    VAImageFormat *fmt;
+    char is_alpha;
+    uint32_t va_rt_format;
+    uint32_t depth;
+};
+
+struct kmsvnc_va_convert;
+
+extern const struct va_fmt_data va_formats_to_try[];
+extern const int va_formats_to_try_len;
+
 void va_cleanup();
 int va_init();
+int va_import_surface();
+void va_release_surface(VASurfaceID surface_id, VAImage *image, char *imgbuf);
 int va_hwframe_to_vaapi(char *out);
+int va_convert(char *out);
+void va_plan_convert(const VAImageFormat *fmt, struct kmsvnc_va_convert *plan);
+void va_convert_image(const struct kmsvnc_va_convert *plan, char *out, const char *in, int width, int height, int pitch);